@@ -0,0 +1,436 @@
+// bench.c
+// Micro- and macrobenchmarks of the sound_seg library, printed as JSON.
+// Built and run by `make bench`; `--quick` shrinks every case for PGO training runs.
+#define _POSIX_C_SOURCE 200809L
+#include "sound_seg.h"
+#include "wav_utils.h"
+#include "dot_kernels.h"
+#include "slab_pool.h"
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifndef BENCH_FLAGS
+#define BENCH_FLAGS "unknown"
+#endif
+
+// Repetitions of every timed case; the median is reported
+#define BENCH_REPEAT 5
+
+// Allocations made through the C allocator, counted by the --wrap linker wrappers below
+size_t bench_allocs = 0;
+
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t count, size_t size);
+void* __real_realloc(void* ptr, size_t size);
+void* __real_aligned_alloc(size_t alignment, size_t size);
+
+// Count a malloc
+void* __wrap_malloc(size_t size) {
+    bench_allocs++;
+    return __real_malloc(size);
+}
+
+// Count a calloc
+void* __wrap_calloc(size_t count, size_t size) {
+    bench_allocs++;
+    return __real_calloc(count, size);
+}
+
+// Count a realloc
+void* __wrap_realloc(void* ptr, size_t size) {
+    bench_allocs++;
+    return __real_realloc(ptr, size);
+}
+
+// Count an aligned_alloc
+void* __wrap_aligned_alloc(size_t alignment, size_t size) {
+    bench_allocs++;
+    return __real_aligned_alloc(alignment, size);
+}
+
+// Options and output state of one run
+typedef struct bench_run {
+    bool quick;
+    bool first;                // no result printed yet
+    uint64_t rng;
+    char wav_path[64];
+} bench_run;
+
+// Return a monotonic time in seconds
+double bench_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Return the next value of a xorshift generator, so every run sees the same data
+uint64_t bench_random(bench_run* run) {
+    run->rng ^= run->rng << 13;
+    run->rng ^= run->rng >> 7;
+    run->rng ^= run->rng << 17;
+    return run->rng;
+}
+
+// Fill a buffer with reproducible noise
+void bench_fill(bench_run* run, int16_t* samples, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        samples[i] = (int16_t)(bench_random(run) >> 48);
+    }
+}
+
+// Order doubles for qsort
+int bench_compare(const void* a, const void* b) {
+    double x = *(const double*) a;
+    double y = *(const double*) b;
+    return (x > y) - (x < y);
+}
+
+// Return the median of `count` timings
+double bench_median(double* times, size_t count) {
+    qsort(times, count, sizeof(double), bench_compare);
+    return times[count / 2];
+}
+
+// Print one result as a JSON object; `segments` is omitted when 0
+void bench_report(bench_run* run, const char* name, double value, const char* unit, size_t segments) {
+    printf("%s\n    { \"name\": \"%s\", \"value\": %.6g, \"unit\": \"%s\"",
+           run->first ? "" : ",", name, value, unit);
+    if (segments > 0) {
+        printf(", \"segments\": %zu", segments);
+    }
+    printf(" }");
+    run->first = false;
+}
+
+// Return a track of `len` noise samples written in one call
+sound_seg* bench_track(bench_run* run, size_t len) {
+    int16_t* samples = (int16_t*) malloc(len * sizeof(int16_t));
+    sound_seg* track = tr_init();
+    bench_fill(run, samples, len);
+    tr_write(track, samples, 0, len);
+    free(samples);
+    return track;
+}
+
+// Cut a track into about `segments` segments by inserting short pieces of another
+// track, so that none of its own samples become covered and undeletable
+void bench_fragment(bench_run* run, sound_seg* track, size_t segments) {
+    sound_seg* donor = bench_track(run, 4096);
+    while (segments > 3) {
+        size_t len = tr_length(track);
+        tr_insert(donor, track, bench_random(run) % len, bench_random(run) % 4000, 16);
+        segments -= 3;
+    }
+    tr_destroy(donor);
+}
+
+// The dot product tr_identify computed before the int16 kernels: one sample at a time,
+// converted to double, kept as the reference the kernels' speedup is measured against
+int64_t bench_dot_double(const int16_t* a, const int16_t* b, size_t len) {
+    double sum = 0.0;
+    for (size_t i = 0; i < len; i++) {
+        sum += (double)a[i] * (double)b[i];
+    }
+    return (int64_t)sum;
+}
+
+// Throughput of every dot product kernel the CPU supports, and of the double loop
+// they replaced
+void bench_kernels(bench_run* run) {
+    static const char* names[] = { "double", "scalar", "sse2", "avx2", "avx512" };
+    static const dot_kernel kernels[] = { bench_dot_double, dot_i16_scalar, dot_i16_sse2, dot_i16_avx2,
+                                          dot_i16_avx512 };
+    size_t len = 4096;
+    size_t calls = run->quick ? 2000 : 50000;
+
+    int16_t* a = (int16_t*) aligned_alloc(64, len * sizeof(int16_t));
+    int16_t* b = (int16_t*) aligned_alloc(64, len * sizeof(int16_t));
+    bench_fill(run, a, len);
+    bench_fill(run, b, len);
+
+    for (size_t k = 0; k < sizeof(names) / sizeof(names[0]); k++) {
+        if (kernels[k] != bench_dot_double && !dot_kernel_supported(names[k])) continue;
+
+        double times[BENCH_REPEAT];
+        volatile int64_t sink = 0;
+        for (int r = 0; r < BENCH_REPEAT; r++) {
+            double start = bench_now();
+            for (size_t i = 0; i < calls; i++) {
+                sink += kernels[k](a, b, len);
+            }
+            times[r] = bench_now() - start;
+        }
+
+        char name[64];
+        snprintf(name, sizeof(name), "dot_%s", names[k]);
+        bench_report(run, name, calls * len / bench_median(times, BENCH_REPEAT), "samples/s", 0);
+    }
+    free(a);
+    free(b);
+}
+
+// Cost of one allocate/free pair in a slab pool, with a working set of live objects
+void bench_slab(bench_run* run) {
+    size_t live = 1024;
+    size_t rounds = run->quick ? 200 : 5000;
+    void** objects = (void**) malloc(live * sizeof(void*));
+    slab_pool* pool = slab_pool_create(64);
+
+    double times[BENCH_REPEAT];
+    for (int r = 0; r < BENCH_REPEAT; r++) {
+        double start = bench_now();
+        for (size_t round = 0; round < rounds; round++) {
+            for (size_t i = 0; i < live; i++) {
+                objects[i] = slab_alloc(pool);
+            }
+            for (size_t i = 0; i < live; i++) {
+                slab_free(objects[i]);
+            }
+        }
+        times[r] = bench_now() - start;
+    }
+
+    bench_report(run, "slab_alloc_free", bench_median(times, BENCH_REPEAT) * 1e9 / (rounds * live), "ns/op", 0);
+    slab_pool_release(pool);
+    free(objects);
+}
+
+// Append, overwrite and read throughput, the reads over a fragmented track
+void bench_read_write(bench_run* run) {
+    size_t total = run->quick ? (1 << 20) : (1 << 24);
+    size_t chunk = 4096;
+    int16_t* buffer = (int16_t*) malloc(chunk * sizeof(int16_t));
+    bench_fill(run, buffer, chunk);
+
+    double append[BENCH_REPEAT], overwrite[BENCH_REPEAT];
+    for (int r = 0; r < BENCH_REPEAT; r++) {
+        sound_seg* track = tr_init();
+        double start = bench_now();
+        for (size_t pos = 0; pos < total; pos += chunk) {
+            tr_write(track, buffer, pos, chunk);
+        }
+        append[r] = bench_now() - start;
+
+        start = bench_now();
+        for (size_t pos = 0; pos < total; pos += chunk) {
+            tr_write(track, buffer, pos, chunk);
+        }
+        overwrite[r] = bench_now() - start;
+        tr_destroy(track);
+    }
+    bench_report(run, "tr_write_append", total / bench_median(append, BENCH_REPEAT), "samples/s", 0);
+    bench_report(run, "tr_write_overwrite", total / bench_median(overwrite, BENCH_REPEAT), "samples/s", 0);
+
+    size_t segments = run->quick ? 1000 : 10000;
+    sound_seg* track = bench_track(run, total);
+    bench_fragment(run, track, segments);
+    size_t len = tr_length(track);
+    double read[BENCH_REPEAT];
+    for (int r = 0; r < BENCH_REPEAT; r++) {
+        double start = bench_now();
+        for (size_t pos = 0; pos < len; pos += chunk) {
+            tr_read(track, buffer, pos, chunk);
+        }
+        read[r] = bench_now() - start;
+    }
+    bench_report(run, "tr_read", len / bench_median(read, BENCH_REPEAT), "samples/s", segments);
+
+    tr_destroy(track);
+    free(buffer);
+}
+
+// Latency and allocations of an insert and a delete at random positions, as the
+// number of segments grows
+void bench_edit(bench_run* run) {
+    size_t sizes[] = { 100, 1000, 10000, 100000 };
+    size_t count = run->quick ? 3 : 4;
+    size_t ops = run->quick ? 500 : 5000;
+
+    for (size_t s = 0; s < count; s++) {
+        sound_seg* track = bench_track(run, 1 << 20);
+        sound_seg* source = bench_track(run, 4096);
+        bench_fragment(run, track, sizes[s]);
+
+        double times[BENCH_REPEAT];
+        size_t allocs = 0;
+        for (int r = 0; r < BENCH_REPEAT; r++) {
+            size_t before = bench_allocs;
+            double start = bench_now();
+            for (size_t i = 0; i < ops; i++) {
+                size_t len = tr_length(track);
+                tr_insert(source, track, bench_random(run) % len, bench_random(run) % 4000, 64);
+                tr_delete_range(track, bench_random(run) % (len - 64), 64);
+            }
+            times[r] = bench_now() - start;
+            allocs = bench_allocs - before;
+        }
+
+        bench_report(run, "insert_delete_latency", bench_median(times, BENCH_REPEAT) * 1e9 / (2 * ops),
+                     "ns/op", sizes[s]);
+        bench_report(run, "insert_delete_allocs", (double)allocs / (2 * ops), "allocs/op", sizes[s]);
+        tr_destroy(source);
+        tr_destroy(track);
+    }
+}
+
+// Time per segment visited by a full compaction of a track split into adjacent pieces
+// of its own block by insert/delete churn, and the read throughput it wins back
+void bench_compact(bench_run* run) {
+    size_t total = run->quick ? (1 << 20) : (1 << 24);
+    size_t segments = run->quick ? 1000 : 10000;
+    size_t chunk = 4096;
+    int16_t* buffer = (int16_t*) malloc(chunk * sizeof(int16_t));
+
+    double compact[BENCH_REPEAT], read[BENCH_REPEAT];
+    for (int r = 0; r < BENCH_REPEAT; r++) {
+        sound_seg* track = bench_track(run, total);
+        sound_seg* donor = bench_track(run, 64);
+        for (size_t i = 1; i < segments; i++) {
+            size_t pos = bench_random(run) % total;
+            tr_insert(donor, track, pos, 0, 16);
+            tr_delete_range(track, pos, 16);
+        }
+        tr_destroy(donor);
+
+        tr_compact_policy policy = { 0, 0, 0, 0 };
+        double start = bench_now();
+        tr_compact(track, &policy);
+        compact[r] = bench_now() - start;
+
+        start = bench_now();
+        for (size_t pos = 0; pos < total; pos += chunk) {
+            tr_read(track, buffer, pos, chunk);
+        }
+        read[r] = bench_now() - start;
+        tr_destroy(track);
+    }
+    bench_report(run, "tr_compact", bench_median(compact, BENCH_REPEAT) * 1e9 / segments,
+                 "ns/segment", segments);
+    bench_report(run, "tr_read_compacted", total / bench_median(read, BENCH_REPEAT), "samples/s", 1);
+    free(buffer);
+}
+
+// A track of mostly silence with a burst of noise in every tenth of each 10000 samples,
+// like speech with pauses
+sound_seg* bench_sparse_track(bench_run* run, size_t len) {
+    int16_t* samples = (int16_t*) calloc(len, sizeof(int16_t));
+    for (size_t pos = 0; pos < len; pos += 10000) {
+        size_t burst = (len - pos < 1000) ? len - pos : 1000;
+        bench_fill(run, samples + pos, burst);
+    }
+    sound_seg* track = tr_init();
+    tr_write(track, samples, 0, len);
+    free(samples);
+    return track;
+}
+
+// Target samples scanned per second for a short ad (direct kernel) and a long one (FFT),
+// over noise and over mostly silence, with the normalized cross-correlation, and coarse to
+// fine from 4 halvings of the rate, whose repeats reuse the cached pyramids
+void bench_identify(bench_run* run) {
+    size_t target_len = run->quick ? (1 << 18) : (1 << 22);
+    size_t ad_lens[] = { 64, 4096, 64, 4096, 4096, 4096 };
+    const char* names[] = { "tr_identify_direct", "tr_identify_fft", "tr_identify_direct_sparse",
+                            "tr_identify_fft_sparse", "tr_identify_ncc", "tr_identify_coarse" };
+
+    sound_seg* targets[] = { bench_track(run, target_len), bench_sparse_track(run, target_len) };
+    for (size_t k = 0; k < 6; k++) {
+        sound_seg* target = targets[(k == 2 || k == 3) ? 1 : 0];
+        tr_identify_opts opts = { k == 4, 0.0, (k == 5) ? 4 : 0, 0.0 };
+        sound_seg* ad = tr_init();
+        int16_t* samples = (int16_t*) malloc(ad_lens[k] * sizeof(int16_t));
+        tr_read(target, samples, target_len / 3 / 10000 * 10000, ad_lens[k]);
+        tr_write(ad, samples, 0, ad_lens[k]);
+        free(samples);
+
+        double times[BENCH_REPEAT];
+        for (int r = 0; r < BENCH_REPEAT; r++) {
+            double start = bench_now();
+            tr_identify_ex(target, ad, &opts, NULL, 0);
+            times[r] = bench_now() - start;
+        }
+        bench_report(run, names[k], target_len / bench_median(times, BENCH_REPEAT), "samples/s", 0);
+        tr_destroy(ad);
+    }
+    tr_destroy(targets[0]);
+    tr_destroy(targets[1]);
+}
+
+// WAV save and load bandwidth through the buffer API and the track API
+// Loads read a file just written, so they measure the page cache rather than the disk
+void bench_wav(bench_run* run) {
+    size_t len = run->quick ? (1 << 20) : (1 << 24);
+    double megabytes = len * sizeof(int16_t) / 1e6;
+    int16_t* samples = (int16_t*) malloc(len * sizeof(int16_t));
+    bench_fill(run, samples, len);
+
+    double save[BENCH_REPEAT], load[BENCH_REPEAT], track_save[BENCH_REPEAT], track_load[BENCH_REPEAT];
+    sound_seg* track = bench_track(run, len);
+    bench_fragment(run, track, 1000);
+    for (int r = 0; r < BENCH_REPEAT; r++) {
+        double start = bench_now();
+        wav_save(run->wav_path, samples, len);
+        save[r] = bench_now() - start;
+
+        start = bench_now();
+        wav_load(run->wav_path, samples);
+        load[r] = bench_now() - start;
+
+        start = bench_now();
+        tr_save_wav(track, run->wav_path);
+        track_save[r] = bench_now() - start;
+
+        // Touch every sample so the mapping is actually read
+        start = bench_now();
+        sound_seg* loaded = tr_load_wav(run->wav_path);
+        tr_span_iter it;
+        size_t run_len;
+        const int16_t* data;
+        volatile int64_t sum = 0;
+        tr_span_begin(&it, loaded, 0, tr_length(loaded));
+        while ((data = tr_span_next(&it, &run_len))) {
+            for (size_t i = 0; i < run_len; i++) sum += data[i];
+        }
+        tr_destroy(loaded);
+        track_load[r] = bench_now() - start;
+    }
+
+    bench_report(run, "wav_save", megabytes / bench_median(save, BENCH_REPEAT), "MB/s", 0);
+    bench_report(run, "wav_load", megabytes / bench_median(load, BENCH_REPEAT), "MB/s", 0);
+    bench_report(run, "tr_save_wav", megabytes / bench_median(track_save, BENCH_REPEAT), "MB/s", 0);
+    bench_report(run, "tr_load_wav", megabytes / bench_median(track_load, BENCH_REPEAT), "MB/s", 0);
+
+    tr_destroy(track);
+    free(samples);
+    unlink(run->wav_path);
+}
+
+int main(int argc, char** argv) {
+    bench_run run;
+    run.quick = (argc > 1 && strcmp(argv[1], "--quick") == 0);
+    run.first = true;
+    run.rng = 0x9e3779b97f4a7c15ULL;
+    snprintf(run.wav_path, sizeof(run.wav_path), "/tmp/sound_seg_bench_%ld.wav", (long)getpid());
+
+    const char* kernel = "";
+    dot_kernel_select(&kernel);
+    printf("{\n  \"quick\": %s,\n  \"flags\": \"%s\",\n  \"dot_kernel\": \"%s\",\n  \"results\": [",
+           run.quick ? "true" : "false", BENCH_FLAGS, kernel);
+
+    bench_kernels(&run);
+    bench_slab(&run);
+    bench_read_write(&run);
+    bench_edit(&run);
+    bench_compact(&run);
+    bench_identify(&run);
+    bench_wav(&run);
+
+    printf("\n  ]\n}\n");
+    return 0;
+}
@@ -0,0 +1,159 @@
+#include "coverage_map.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Initialize a map with no runs
+void coverage_init(coverage_map* map) {
+    map->starts = NULL;
+    map->counts = NULL;
+    map->runs = 0;
+    map->capacity = 0;
+}
+
+// Free the run arrays and reset the map to empty
+void coverage_free(coverage_map* map) {
+    free(map->starts);
+    free(map->counts);
+    coverage_init(map);
+}
+
+// Return the number of runs starting at or before `pos`
+size_t coverage_upper_bound(const coverage_map* map, size_t pos) {
+    size_t lo = 0;
+    size_t hi = map->runs;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (map->starts[mid] <= pos) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// Make room for `extra` more runs
+bool coverage_reserve(coverage_map* map, size_t extra) {
+    if (map->runs + extra <= map->capacity) {
+        return true;
+    }
+
+    size_t new_cap = map->capacity == 0 ? 4 : map->capacity * 2;
+    while (new_cap < map->runs + extra) {
+        new_cap *= 2;
+    }
+
+    size_t* starts = (size_t*) realloc(map->starts, new_cap * sizeof(size_t));
+    if (!starts) return false;
+    map->starts = starts;
+
+    size_t* counts = (size_t*) realloc(map->counts, new_cap * sizeof(size_t));
+    if (!counts) return false;
+    map->counts = counts;
+
+    map->capacity = new_cap;
+    return true;
+}
+
+// Return the index of the run starting at `pos`, splitting the run containing it
+// Room for the new run must already be reserved
+size_t coverage_boundary(coverage_map* map, size_t pos) {
+    size_t i = coverage_upper_bound(map, pos);
+    if (i > 0 && map->starts[i - 1] == pos) {
+        return i - 1;
+    }
+
+    memmove(map->starts + i + 1, map->starts + i, (map->runs - i) * sizeof(size_t));
+    memmove(map->counts + i + 1, map->counts + i, (map->runs - i) * sizeof(size_t));
+    map->starts[i] = pos;
+    map->counts[i] = (i > 0) ? map->counts[i - 1] : 0;
+    map->runs++;
+    return i;
+}
+
+// Remove run `i`, letting the previous run extend over it
+void coverage_remove_run(coverage_map* map, size_t i) {
+    memmove(map->starts + i, map->starts + i + 1, (map->runs - i - 1) * sizeof(size_t));
+    memmove(map->counts + i, map->counts + i + 1, (map->runs - i - 1) * sizeof(size_t));
+    map->runs--;
+}
+
+// Shift the counts of [start, end) by +1 or -1, then merge runs that became equal
+bool coverage_update(coverage_map* map, size_t start, size_t end, bool add) {
+    if (start >= end) {
+        return true;
+    }
+    if (!coverage_reserve(map, 2)) {
+        return false;
+    }
+
+    size_t first = coverage_boundary(map, start);
+    size_t last = coverage_boundary(map, end);
+    for (size_t i = first; i < last; i++) {
+        if (add) {
+            map->counts[i]++;
+        }
+        else {
+            map->counts[i]--;
+        }
+    }
+
+    // Runs inside the range moved together, so only its two ends can match a neighbour
+    if (map->counts[last] == map->counts[last - 1]) {
+        coverage_remove_run(map, last);
+    }
+    if (first > 0 && map->counts[first] == map->counts[first - 1]) {
+        coverage_remove_run(map, first);
+    }
+    if (map->runs > 0 && map->counts[0] == 0) {
+        coverage_remove_run(map, 0);
+    }
+    return true;
+}
+
+// Cover [start, end) once more
+bool coverage_add(coverage_map* map, size_t start, size_t end) {
+    return coverage_update(map, start, end, true);
+}
+
+// Drop one layer of cover from [start, end)
+bool coverage_remove(coverage_map* map, size_t start, size_t end) {
+    return coverage_update(map, start, end, false);
+}
+
+// Scan the runs overlapping [start, end) for a nonzero count
+bool coverage_any(const coverage_map* map, size_t start, size_t end) {
+    if (start >= end) {
+        return false;
+    }
+
+    size_t i = coverage_upper_bound(map, start);
+    if (i > 0 && map->counts[i - 1] != 0) {
+        return true;
+    }
+    for (; i < map->runs && map->starts[i] < end; i++) {
+        if (map->counts[i] != 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Sum the lengths of the nonzero runs overlapping [start, end), clipped to the range
+size_t coverage_covered(const coverage_map* map, size_t start, size_t end) {
+    size_t covered = 0;
+    size_t i = coverage_upper_bound(map, start);
+    if (i > 0) {
+        i--;
+    }
+
+    for (; i < map->runs && map->starts[i] < end; i++) {
+        size_t run_start = map->starts[i] > start ? map->starts[i] : start;
+        size_t run_end = (i + 1 < map->runs && map->starts[i + 1] < end) ? map->starts[i + 1] : end;
+        if (map->counts[i] != 0 && run_start < run_end) {
+            covered += run_end - run_start;
+        }
+    }
+    return covered;
+}
@@ -0,0 +1,37 @@
+#ifndef COVERAGE_MAP_H
+#define COVERAGE_MAP_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+// Counts over the positions of a one-dimensional index space, stored as sorted runs of
+// equal count. Updates and queries binary-search the runs, so they cost O(log k) plus
+// the runs they touch, where k is the number of distinct range boundaries in use.
+typedef struct coverage_map {
+    size_t* starts;            // run i covers [starts[i], starts[i + 1]); positions before
+    size_t* counts;            // the first run and from the last run on have count 0
+    size_t runs;
+    size_t capacity;
+} coverage_map;
+
+// Initialize an empty map in which every position has count 0.
+void coverage_init(coverage_map* map);
+
+// Free the runs of a map.
+void coverage_free(coverage_map* map);
+
+// Add one to every position in [start, end). Returns false on allocation failure,
+// leaving the map unchanged.
+bool coverage_add(coverage_map* map, size_t start, size_t end);
+
+// Subtract one from every position in [start, end), which must all be covered.
+// Returns false on allocation failure, leaving the map unchanged.
+bool coverage_remove(coverage_map* map, size_t start, size_t end);
+
+// Return true if any position in [start, end) has a nonzero count.
+bool coverage_any(const coverage_map* map, size_t start, size_t end);
+
+// Return how many positions in [start, end) have a nonzero count.
+size_t coverage_covered(const coverage_map* map, size_t start, size_t end);
+
+#endif // COVERAGE_MAP_H
@@ -0,0 +1,163 @@
+#include "dot_kernels.h"
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define DOT_KERNELS_X86 1
+#include <immintrin.h>
+#endif
+
+// pmaddwd sums two int16 products into an int32 lane. The only sum that does not fit is
+// (-32768 * -32768) * 2 = 2^31, which wraps to INT32_MIN; since no true sum can equal
+// INT32_MIN, the vector kernels count those lanes and add 2^32 for each at the end.
+
+// Portable reference kernel
+int64_t dot_i16_scalar(const int16_t* a, const int16_t* b, size_t len) {
+    int64_t sum = 0;
+    for (size_t i = 0; i < len; i++) {
+        sum += (int32_t)a[i] * (int32_t)b[i];
+    }
+    return sum;
+}
+
+#ifdef DOT_KERNELS_X86
+
+// SSE2: 8 samples per step, int64 lanes widened with the sign mask
+__attribute__((target("sse2")))
+int64_t dot_i16_sse2(const int16_t* a, const int16_t* b, size_t len) {
+    const __m128i wrapped = _mm_set1_epi32(INT32_MIN);
+    __m128i acc = _mm_setzero_si128();
+    __m128i fixups = _mm_setzero_si128();
+    size_t i = 0;
+
+    for (; i + 8 <= len; i += 8) {
+        __m128i x = _mm_loadu_si128((const __m128i*)(a + i));
+        __m128i y = _mm_loadu_si128((const __m128i*)(b + i));
+        __m128i p = _mm_madd_epi16(x, y);
+        fixups = _mm_sub_epi32(fixups, _mm_cmpeq_epi32(p, wrapped));
+        __m128i sign = _mm_srai_epi32(p, 31);
+        acc = _mm_add_epi64(acc, _mm_unpacklo_epi32(p, sign));
+        acc = _mm_add_epi64(acc, _mm_unpackhi_epi32(p, sign));
+    }
+
+    int64_t lanes[2];
+    uint32_t counts[4];
+    _mm_storeu_si128((__m128i*)lanes, acc);
+    _mm_storeu_si128((__m128i*)counts, fixups);
+
+    int64_t sum = lanes[0] + lanes[1];
+    sum += (int64_t)((uint64_t)counts[0] + counts[1] + counts[2] + counts[3]) << 32;
+    return sum + dot_i16_scalar(a + i, b + i, len - i);
+}
+
+// AVX2: 16 samples per step
+__attribute__((target("avx2")))
+int64_t dot_i16_avx2(const int16_t* a, const int16_t* b, size_t len) {
+    const __m256i wrapped = _mm256_set1_epi32(INT32_MIN);
+    __m256i acc = _mm256_setzero_si256();
+    __m256i fixups = _mm256_setzero_si256();
+    size_t i = 0;
+
+    for (; i + 16 <= len; i += 16) {
+        __m256i x = _mm256_loadu_si256((const __m256i*)(a + i));
+        __m256i y = _mm256_loadu_si256((const __m256i*)(b + i));
+        __m256i p = _mm256_madd_epi16(x, y);
+        fixups = _mm256_sub_epi32(fixups, _mm256_cmpeq_epi32(p, wrapped));
+        acc = _mm256_add_epi64(acc, _mm256_cvtepi32_epi64(_mm256_castsi256_si128(p)));
+        acc = _mm256_add_epi64(acc, _mm256_cvtepi32_epi64(_mm256_extracti128_si256(p, 1)));
+    }
+
+    int64_t lanes[4];
+    uint32_t counts[8];
+    _mm256_storeu_si256((__m256i*)lanes, acc);
+    _mm256_storeu_si256((__m256i*)counts, fixups);
+
+    int64_t sum = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    uint64_t wraps = 0;
+    for (int k = 0; k < 8; k++) {
+        wraps += counts[k];
+    }
+    sum += (int64_t)wraps << 32;
+    return sum + dot_i16_scalar(a + i, b + i, len - i);
+}
+
+// AVX-512BW: 32 samples per step, wrapped lanes counted from the compare mask
+__attribute__((target("avx512f,avx512bw")))
+int64_t dot_i16_avx512(const int16_t* a, const int16_t* b, size_t len) {
+    const __m512i wrapped = _mm512_set1_epi32(INT32_MIN);
+    __m512i acc = _mm512_setzero_si512();
+    uint64_t wraps = 0;
+    size_t i = 0;
+
+    for (; i + 32 <= len; i += 32) {
+        __m512i x = _mm512_loadu_si512((const void*)(a + i));
+        __m512i y = _mm512_loadu_si512((const void*)(b + i));
+        __m512i p = _mm512_madd_epi16(x, y);
+        wraps += (uint64_t)__builtin_popcount(_mm512_cmpeq_epi32_mask(p, wrapped));
+        acc = _mm512_add_epi64(acc, _mm512_cvtepi32_epi64(_mm512_castsi512_si256(p)));
+        acc = _mm512_add_epi64(acc, _mm512_cvtepi32_epi64(_mm512_extracti64x4_epi64(p, 1)));
+    }
+
+    int64_t sum = _mm512_reduce_add_epi64(acc) + ((int64_t)wraps << 32);
+    return sum + dot_i16_scalar(a + i, b + i, len - i);
+}
+
+#else
+
+// Non-x86 builds fall back to the scalar kernel under every name
+int64_t dot_i16_sse2(const int16_t* a, const int16_t* b, size_t len) {
+    return dot_i16_scalar(a, b, len);
+}
+
+int64_t dot_i16_avx2(const int16_t* a, const int16_t* b, size_t len) {
+    return dot_i16_scalar(a, b, len);
+}
+
+int64_t dot_i16_avx512(const int16_t* a, const int16_t* b, size_t len) {
+    return dot_i16_scalar(a, b, len);
+}
+
+#endif
+
+// Return whether the CPU can run the named kernel
+int dot_kernel_supported(const char* name) {
+    if (strcmp(name, "scalar") == 0) {
+        return 1;
+    }
+#ifdef DOT_KERNELS_X86
+    __builtin_cpu_init();
+    if (strcmp(name, "sse2") == 0) {
+        return __builtin_cpu_supports("sse2");
+    }
+    if (strcmp(name, "avx2") == 0) {
+        return __builtin_cpu_supports("avx2");
+    }
+    if (strcmp(name, "avx512") == 0) {
+        return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw");
+    }
+#endif
+    return 0;
+}
+
+// Pick the widest kernel the CPU supports
+dot_kernel dot_kernel_select(const char** name) {
+    const char* chosen = "scalar";
+    dot_kernel kernel = dot_i16_scalar;
+
+    if (dot_kernel_supported("avx512")) {
+        chosen = "avx512";
+        kernel = dot_i16_avx512;
+    }
+    else if (dot_kernel_supported("avx2")) {
+        chosen = "avx2";
+        kernel = dot_i16_avx2;
+    }
+    else if (dot_kernel_supported("sse2")) {
+        chosen = "sse2";
+        kernel = dot_i16_sse2;
+    }
+
+    if (name) {
+        *name = chosen;
+    }
+    return kernel;
+}
@@ -0,0 +1,24 @@
+#ifndef DOT_KERNELS_H
+#define DOT_KERNELS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// An exact dot product of two int16 vectors.
+typedef int64_t (*dot_kernel)(const int16_t* a, const int16_t* b, size_t len);
+
+// Portable reference kernel.
+int64_t dot_i16_scalar(const int16_t* a, const int16_t* b, size_t len);
+
+// x86 kernels; only call the ones dot_kernel_supported() reports as available.
+int64_t dot_i16_sse2(const int16_t* a, const int16_t* b, size_t len);
+int64_t dot_i16_avx2(const int16_t* a, const int16_t* b, size_t len);
+int64_t dot_i16_avx512(const int16_t* a, const int16_t* b, size_t len);
+
+// Return whether the CPU can run the named kernel ("scalar", "sse2", "avx2", "avx512").
+int dot_kernel_supported(const char* name);
+
+// Return the fastest kernel supported by the CPU, and its name through `name` if non-NULL.
+dot_kernel dot_kernel_select(const char** name);
+
+#endif // DOT_KERNELS_H
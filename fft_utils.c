@@ -0,0 +1,213 @@
+#include "fft_utils.h"
+#include <stdlib.h>
+
+#define FFT_PI 3.14159265358979323846
+
+// Tables for a real transform of length n, computed through a complex transform of n / 2
+struct fft_plan {
+    size_t n;
+    size_t half;
+    fft_complex* twiddle;   // e^(-2*pi*i*k/half) for k < half / 2
+    fft_complex* unpack;    // e^(-2*pi*i*k/n) for k <= half / 2
+};
+
+// Evaluate sin and cos for an angle in [0, pi/4] with Taylor series
+void fft_sincos_small(double x, double* s, double* c) {
+    double x2 = x * x;
+    double term_s = x;
+    double term_c = 1.0;
+    double sum_s = x;
+    double sum_c = 1.0;
+
+    for (int k = 1; k < 12; k++) {
+        term_s *= -x2 / ((2.0 * k) * (2.0 * k + 1.0));
+        term_c *= -x2 / ((2.0 * k - 1.0) * (2.0 * k));
+        sum_s += term_s;
+        sum_c += term_c;
+    }
+    *s = sum_s;
+    *c = sum_c;
+}
+
+// Return e^(-2*pi*i*k/n) without depending on libm
+fft_complex fft_root(size_t k, size_t n) {
+    k %= n;
+    size_t quadrant = (4 * k) / n;
+    size_t rem = 4 * k - quadrant * n;    // angle within the quadrant, in units of pi/(2n)
+    double s, c;
+
+    if (2 * rem <= n) {
+        fft_sincos_small(FFT_PI * 0.5 * (double)rem / (double)n, &s, &c);
+    }
+    else {
+        fft_sincos_small(FFT_PI * 0.5 * (double)(n - rem) / (double)n, &c, &s);
+    }
+
+    // Rotate the first quadrant result into place, then negate the angle
+    fft_complex w;
+    switch (quadrant) {
+        case 0: w.re = c; w.im = s; break;
+        case 1: w.re = -s; w.im = c; break;
+        case 2: w.re = -c; w.im = -s; break;
+        default: w.re = s; w.im = -c; break;
+    }
+    w.im = -w.im;
+    return w;
+}
+
+// Create the twiddle tables for a real transform of length n
+fft_plan* fft_plan_create(size_t n) {
+    if (n < 4 || (n & (n - 1)) != 0) {
+        return NULL;
+    }
+
+    fft_plan* plan = (fft_plan*) malloc(sizeof(fft_plan));
+    if (!plan) return NULL;
+
+    plan->n = n;
+    plan->half = n / 2;
+    plan->twiddle = (fft_complex*) malloc((plan->half / 2) * sizeof(fft_complex));
+    plan->unpack = (fft_complex*) malloc((plan->half / 2 + 1) * sizeof(fft_complex));
+    if (!plan->twiddle || !plan->unpack) {
+        fft_plan_destroy(plan);
+        return NULL;
+    }
+
+    for (size_t k = 0; k < plan->half / 2; k++) {
+        plan->twiddle[k] = fft_root(k, plan->half);
+    }
+    for (size_t k = 0; k <= plan->half / 2; k++) {
+        plan->unpack[k] = fft_root(k, n);
+    }
+    return plan;
+}
+
+// Destroy a plan and its tables
+void fft_plan_destroy(fft_plan* plan) {
+    if (!plan) return;
+
+    free(plan->twiddle);
+    free(plan->unpack);
+    free(plan);
+}
+
+// Return the real transform length of a plan
+size_t fft_plan_length(const fft_plan* plan) {
+    return plan ? plan->n : 0;
+}
+
+// In-place iterative radix-2 complex FFT of length plan->half
+// `inverse` selects the conjugate twiddles; no scaling is applied
+void fft_complex_transform(const fft_plan* plan, fft_complex* data, int inverse) {
+    size_t n = plan->half;
+
+    for (size_t i = 1, j = 0; i < n; i++) {
+        size_t bit = n >> 1;
+        for (; j & bit; bit >>= 1) {
+            j ^= bit;
+        }
+        j ^= bit;
+        if (i < j) {
+            fft_complex tmp = data[i];
+            data[i] = data[j];
+            data[j] = tmp;
+        }
+    }
+
+    for (size_t len = 2; len <= n; len <<= 1) {
+        size_t half_len = len >> 1;
+        size_t stride = n / len;
+        for (size_t start = 0; start < n; start += len) {
+            for (size_t k = 0; k < half_len; k++) {
+                fft_complex w = plan->twiddle[k * stride];
+                if (inverse) {
+                    w.im = -w.im;
+                }
+                fft_complex* a = &data[start + k];
+                fft_complex* b = &data[start + k + half_len];
+                double re = b->re * w.re - b->im * w.im;
+                double im = b->re * w.im + b->im * w.re;
+                b->re = a->re - re;
+                b->im = a->im - im;
+                a->re += re;
+                a->im += im;
+            }
+        }
+    }
+}
+
+// Forward real FFT: pack even/odd samples as one complex sequence, transform, then unpack
+void fft_forward_real(const fft_plan* plan, const double* in, fft_complex* out) {
+    size_t half = plan->half;
+
+    for (size_t k = 0; k < half; k++) {
+        out[k].re = in[2 * k];
+        out[k].im = in[2 * k + 1];
+    }
+
+    fft_complex_transform(plan, out, 0);
+
+    fft_complex z0 = out[0];
+    out[0].re = z0.re + z0.im;
+    out[0].im = 0.0;
+    out[half].re = z0.re - z0.im;
+    out[half].im = 0.0;
+
+    for (size_t k = 1; k <= half / 2; k++) {
+        fft_complex zk = out[k];
+        fft_complex zm = out[half - k];
+
+        // Even and odd spectra at bin k
+        double even_re = 0.5 * (zk.re + zm.re);
+        double even_im = 0.5 * (zk.im - zm.im);
+        double odd_re = 0.5 * (zk.im + zm.im);
+        double odd_im = -0.5 * (zk.re - zm.re);
+
+        fft_complex w = plan->unpack[k];
+        double rot_re = odd_re * w.re - odd_im * w.im;
+        double rot_im = odd_re * w.im + odd_im * w.re;
+
+        out[k].re = even_re + rot_re;
+        out[k].im = even_im + rot_im;
+        out[half - k].re = even_re - rot_re;
+        out[half - k].im = -(even_im - rot_im);
+    }
+}
+
+// Inverse real FFT: rebuild the packed complex spectrum, transform, then interleave
+void fft_inverse_real(const fft_plan* plan, fft_complex* spectrum, double* out) {
+    size_t half = plan->half;
+
+    double x0 = spectrum[0].re;
+    double xh = spectrum[half].re;
+    spectrum[0].re = 0.5 * (x0 + xh);
+    spectrum[0].im = 0.5 * (x0 - xh);
+
+    for (size_t k = 1; k <= half / 2; k++) {
+        fft_complex xk = spectrum[k];
+        fft_complex xm = spectrum[half - k];
+
+        double even_re = 0.5 * (xk.re + xm.re);
+        double even_im = 0.5 * (xk.im - xm.im);
+        double diff_re = 0.5 * (xk.re - xm.re);
+        double diff_im = 0.5 * (xk.im + xm.im);
+
+        // Odd spectrum is the difference rotated by the conjugate unpack root
+        fft_complex w = plan->unpack[k];
+        double odd_re = diff_re * w.re + diff_im * w.im;
+        double odd_im = diff_im * w.re - diff_re * w.im;
+
+        spectrum[k].re = even_re - odd_im;
+        spectrum[k].im = even_im + odd_re;
+        spectrum[half - k].re = even_re + odd_im;
+        spectrum[half - k].im = -even_im + odd_re;
+    }
+
+    fft_complex_transform(plan, spectrum, 1);
+
+    double scale = 1.0 / (double)half;
+    for (size_t k = 0; k < half; k++) {
+        out[2 * k] = spectrum[k].re * scale;
+        out[2 * k + 1] = spectrum[k].im * scale;
+    }
+}
@@ -0,0 +1,31 @@
+#ifndef FFT_UTILS_H
+#define FFT_UTILS_H
+
+#include <stddef.h>
+
+// A complex value as used by the FFT routines.
+typedef struct fft_complex {
+    double re;
+    double im;
+} fft_complex;
+
+// Precomputed tables for real FFTs of one power-of-two length.
+typedef struct fft_plan fft_plan;
+
+// Create a plan for real transforms of length `n` (a power of two, at least 4).
+fft_plan* fft_plan_create(size_t n);
+
+// Destroy a plan created by fft_plan_create.
+void fft_plan_destroy(fft_plan* plan);
+
+// Return the real transform length of a plan.
+size_t fft_plan_length(const fft_plan* plan);
+
+// Transform `n` real samples into `n / 2 + 1` spectrum bins.
+void fft_forward_real(const fft_plan* plan, const double* in, fft_complex* out);
+
+// Transform `n / 2 + 1` bins of a Hermitian spectrum back into `n` real samples.
+// The spectrum is used as scratch space and is overwritten.
+void fft_inverse_real(const fft_plan* plan, fft_complex* spectrum, double* out);
+
+#endif // FFT_UTILS_H
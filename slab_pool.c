@@ -0,0 +1,242 @@
+#include "slab_pool.h"
+#include "spinlock.h"
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#if defined(__SANITIZE_ADDRESS__)
+#include <sanitizer/asan_interface.h>
+#define SLAB_POISON(addr, size) ASAN_POISON_MEMORY_REGION((addr), (size))
+#define SLAB_UNPOISON(addr, size) ASAN_UNPOISON_MEMORY_REGION((addr), (size))
+#else
+#define SLAB_POISON(addr, size) ((void)(addr), (void)(size))
+#define SLAB_UNPOISON(addr, size) ((void)(addr), (void)(size))
+#endif
+
+// Size and alignment of a slab; an object's slab is found by masking its address
+#define SLAB_SIZE 4096
+
+// Alignment of every object handed out
+#define SLAB_ALIGN 16
+
+// Header at the start of every slab
+typedef struct slab {
+    struct slab_pool* pool;
+    struct slab* next;         // neighbours in the pool's list of slabs with free objects
+    struct slab* prev;
+    void* free_list;           // freed objects, linked through their first word
+    size_t used;               // live objects
+    size_t bump;               // objects never handed out start at this index
+} slab;
+
+// Objects may be freed from any thread, so the lists are guarded by `lock`
+struct slab_pool {
+    spinlock lock;
+    size_t object_size;
+    size_t per_slab;
+    slab* partial;             // slabs with at least one free object
+    slab* spare;               // one empty slab kept to absorb alloc/free churn
+    size_t free_slots;         // objects that can be allocated from the partial slabs
+    size_t reserved;           // free objects to keep rather than return empty slabs
+    size_t live;
+    bool released;             // the owner is gone; free the pool with its last object
+};
+
+// Round `size` up to a multiple of SLAB_ALIGN
+size_t slab_round(size_t size) {
+    return (size + SLAB_ALIGN - 1) / SLAB_ALIGN * SLAB_ALIGN;
+}
+
+// Return the address of object `index` of a slab
+char* slab_object(const slab_pool* pool, slab* s, size_t index) {
+    return (char*)s + slab_round(sizeof(slab)) + index * pool->object_size;
+}
+
+// Create a pool for objects that fit several to a slab
+slab_pool* slab_pool_create(size_t object_size) {
+    size_t size = slab_round(object_size < sizeof(void*) ? sizeof(void*) : object_size);
+    size_t per_slab = (SLAB_SIZE - slab_round(sizeof(slab))) / size;
+    if (object_size == 0 || per_slab < 2) {
+        return NULL;
+    }
+
+    slab_pool* pool = (slab_pool*) calloc(1, sizeof(slab_pool));
+    if (!pool) return NULL;
+
+    spinlock_init(&pool->lock);
+    pool->object_size = size;
+    pool->per_slab = per_slab;
+    return pool;
+}
+
+// Unlink a slab from the pool's partial list
+void slab_unlink(slab_pool* pool, slab* s) {
+    if (s->prev) {
+        s->prev->next = s->next;
+    }
+    else {
+        pool->partial = s->next;
+    }
+    if (s->next) {
+        s->next->prev = s->prev;
+    }
+    s->next = NULL;
+    s->prev = NULL;
+}
+
+// Link a slab at the head of the pool's partial list
+void slab_link(slab_pool* pool, slab* s) {
+    s->prev = NULL;
+    s->next = pool->partial;
+    if (pool->partial) {
+        pool->partial->prev = s;
+    }
+    pool->partial = s;
+}
+
+// Get an empty slab, reusing the spare one when there is one
+slab* slab_new(slab_pool* pool) {
+    slab* s = pool->spare;
+    if (s) {
+        pool->spare = NULL;
+    }
+    else {
+        s = (slab*) aligned_alloc(SLAB_SIZE, SLAB_SIZE);
+        if (!s) return NULL;
+    }
+
+    s->pool = pool;
+    s->next = NULL;
+    s->prev = NULL;
+    s->free_list = NULL;
+    s->used = 0;
+    s->bump = 0;
+    SLAB_POISON(slab_object(pool, s, 0), pool->per_slab * pool->object_size);
+    return s;
+}
+
+// Free a pool with no live objects: its spare slab, the empty slabs kept for a
+// reservation, and the pool itself
+void slab_pool_destroy(slab_pool* pool) {
+    while (pool->partial) {
+        slab* s = pool->partial;
+        pool->partial = s->next;
+        free(s);
+    }
+    free(pool->spare);
+    free(pool);
+}
+
+// Allocate from the first slab with room, adding a slab when all are full
+void* slab_alloc(slab_pool* pool) {
+    if (!pool) return NULL;
+
+    spin_lock(&pool->lock);
+    slab* s = pool->partial;
+    if (!s) {
+        s = slab_new(pool);
+        if (!s) {
+            spin_unlock(&pool->lock);
+            return NULL;
+        }
+        slab_link(pool, s);
+        pool->free_slots += pool->per_slab;
+    }
+
+    char* object;
+    if (s->free_list) {
+        object = (char*) s->free_list;
+        SLAB_UNPOISON(object, pool->object_size);
+        s->free_list = *(void**)object;
+    }
+    else {
+        object = slab_object(pool, s, s->bump);
+        SLAB_UNPOISON(object, pool->object_size);
+        s->bump++;
+    }
+
+    s->used++;
+    pool->live++;
+    pool->free_slots--;
+    if (s->used == pool->per_slab) {
+        slab_unlink(pool, s);
+    }
+    spin_unlock(&pool->lock);
+    return object;
+}
+
+// Push an object onto its slab's free list, returning empty slabs to the system
+void slab_free(void* object) {
+    if (!object) return;
+
+    slab* s = (slab*)((uintptr_t)object & ~(uintptr_t)(SLAB_SIZE - 1));
+    slab_pool* pool = s->pool;
+
+    spin_lock(&pool->lock);
+    *(void**)object = s->free_list;
+    s->free_list = object;
+    SLAB_POISON(object, pool->object_size);
+
+    if (s->used == pool->per_slab) {
+        slab_link(pool, s);
+    }
+    s->used--;
+    pool->live--;
+    pool->free_slots++;
+
+    if (s->used == 0 && pool->free_slots - pool->per_slab >= pool->reserved) {
+        slab_unlink(pool, s);
+        pool->free_slots -= pool->per_slab;
+        if (!pool->spare && !pool->released) {
+            pool->spare = s;
+        }
+        else {
+            free(s);
+        }
+    }
+
+    bool last = pool->released && pool->live == 0;
+    spin_unlock(&pool->lock);
+    if (last) {
+        slab_pool_destroy(pool);
+    }
+}
+
+// Find the slab header by masking the object's address
+slab_pool* slab_pool_of(void* object) {
+    slab* s = (slab*)((uintptr_t)object & ~(uintptr_t)(SLAB_SIZE - 1));
+    return s->pool;
+}
+
+// Add empty slabs to the partial list until enough objects are free
+bool slab_reserve(slab_pool* pool, size_t count) {
+    if (!pool) return false;
+
+    bool ok = true;
+    spin_lock(&pool->lock);
+    pool->reserved = count;
+    while (pool->free_slots < count) {
+        slab* s = slab_new(pool);
+        if (!s) {
+            ok = false;
+            break;
+        }
+        slab_link(pool, s);
+        pool->free_slots += pool->per_slab;
+    }
+    spin_unlock(&pool->lock);
+    return ok;
+}
+
+// Release the owner's reference, deferring the free while objects are still live
+void slab_pool_release(slab_pool* pool) {
+    if (!pool) return;
+
+    spin_lock(&pool->lock);
+    pool->released = true;
+    bool last = (pool->live == 0);
+    spin_unlock(&pool->lock);
+    if (last) {
+        slab_pool_destroy(pool);
+    }
+}
@@ -0,0 +1,32 @@
+#ifndef SLAB_POOL_H
+#define SLAB_POOL_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+// Allocator for small fixed-size objects carved out of page-sized slabs.
+// Every object remembers its pool through its slab, so an object can be freed after
+// the pool's owner has released it; the pool itself goes away with its last object.
+typedef struct slab_pool slab_pool;
+
+// Create a pool of objects of `object_size` bytes. Slabs are allocated on first use.
+slab_pool* slab_pool_create(size_t object_size);
+
+// Allocate one object, or return NULL if no slab can be allocated.
+void* slab_alloc(slab_pool* pool);
+
+// Return an object to the pool it was allocated from. NULL is ignored.
+void slab_free(void* object);
+
+// Return the pool an object was allocated from.
+slab_pool* slab_pool_of(void* object);
+
+// Make sure the next `count` allocations from the pool succeed without allocating slabs,
+// as long as no other thread allocates from it meanwhile. Returns false on failure.
+bool slab_reserve(slab_pool* pool, size_t count);
+
+// Drop the owner's reference to a pool. The pool is freed now if no objects are live,
+// and otherwise when the last of them is freed.
+void slab_pool_release(slab_pool* pool);
+
+#endif // SLAB_POOL_H
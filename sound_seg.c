@@ -1,3 +1,4 @@
+#define _POSIX_C_SOURCE 200809L
 #include "sound_seg.h"
 #include <stdint.h>
 #include <stddef.h>
@@ -5,655 +6,3293 @@
 #include <stdbool.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <errno.h>
+#include <time.h>
+#include "wav_utils.h"
+#include "xcorr.h"
+#include "dot_kernels.h"
+#include "slab_pool.h"
+#include "coverage_map.h"
+#include "spinlock.h"
+
+// Ads shorter than this are correlated directly instead of through the FFT
+#define IDENTIFY_FFT_MIN_AD 128
+
+// Offsets per block when an identification correlates directly, which is also the work
+// item of a parallel one
+#define IDENTIFY_MT_DIRECT_CHUNK 4096
+
+// Samples of a direct dot product between checks of whether the rest can still reach
+// the threshold
+#define IDENTIFY_PRUNE_CHUNK 64
+
+// A block is correlated through the FFT only when the offsets left after pruning need more
+// than this many multiply-adds per sample of a full block to correlate directly, since the
+// transform costs the same however few of its offsets are used
+#define IDENTIFY_FFT_WORK 16
+
+// A coarse-to-fine identification uses at most this many halvings of the rate, and only as
+// many as leave the ad at least IDENTIFY_COARSE_MIN_AD frames long
+#define PYRAMID_MAX_LEVELS 8
+#define IDENTIFY_COARSE_MIN_AD 32
+
+// Frames of a pyramid level produced per read of the level under it
+#define PYRAMID_CHUNK 4096
+
+// Alignment of audio block allocations, one cache line
+#define BLOCK_ALIGN 64
+
+// Fewest samples a block is allocated for, leaving room for later small appends
+#define BLOCK_MIN_CAPACITY 256
+
+// Appends allocate blocks of twice the tail block's capacity, up to this many samples
+#define BLOCK_MAX_GROWTH (1 << 20)
+
+// Upper bound on the tree passes (splits, merges, spine walks) of one edit, used to
+// reserve enough nodes for copying shared ones before the edit starts
+#define TREE_EDIT_PASSES 16
+
+// Runs of samples gathered into one writev call by tr_save_wav
+#define SAVE_WAV_BATCH 64
+
+// Most segments tr_compact copies into one new block
+#define COMPACT_MAX_RUN 64
+
+// Segments tr_compact visits between reads of the clock
+#define COMPACT_CLOCK_EVERY 16
 
 // Structure representing a block of audio data.
+// The header and samples share one cache-aligned allocation; samples past `length`
+// are spare capacity that appends to the block's last segment can fill in place.
+// A block loaded by tr_load_wav instead points into a private mapping of the file,
+// which is unmapped with the block; pages written through it are copied by the kernel.
 typedef struct audio_block {
+    int16_t* data;
     size_t length;
-    uint16_t refcount;
-    int16_t *data;
+    size_t capacity;
+    _Atomic uint64_t refcount;
+    _Atomic uint64_t writes;   // generation of its samples, advanced by every tr_write to them
+    void* mapping;             // start of the file mapping holding `data`, or NULL
+    size_t mapping_size;
+    int16_t storage[];
 } audio_block;
 
-// Represents a child relationship in the segment tree.
-typedef struct segment_child {
-    struct segment* child;
-    struct segment_child* next;
-} segment_child;
-
-// A segment of audio within a track. Can have parent/child relations for shared data.
+// The samples of one block that a segment held when it was created. Splitting the
+// segment keeps both pieces in the span, so a split never touches other tracks.
+// Inserting a piece elsewhere creates a child span for the copy, and the parent span
+// counts per block offset how many copies cover each sample; covered samples cannot be
+// deleted. A span lives while segments or child spans refer to it.
+// Copies in other tracks update the coverage from their own threads, so it is only
+// touched under `lock`.
+typedef struct span {
+    struct span* parent;
+    _Atomic uint64_t refcount;
+    _Atomic uint64_t children;     // child spans still alive, in any track or snapshot
+    spinlock lock;
+    coverage_map coverage;
+} span;
+
+// A segment of audio within a track: a run of samples of one block, in one span.
+// The segments of a track form a treap ordered by position, where every node caches
+// the number of samples in its subtree so that lookups, splits and splices are O(log n).
+// The treap is persistent: snapshots share nodes with the track, a node referenced more
+// than once is never changed, and edits copy the shared nodes on the paths they touch.
 typedef struct segment {
     size_t offset;
     size_t length;
-    struct segment* parent;
-    struct segment_child* children;
-    struct segment *next;
     audio_block *block;
-    uint16_t refcount;
+    span* span;
+    struct segment* left;
+    struct segment* right;
+    _Atomic uint64_t refcount;     // parent nodes and track versions pointing here
+    size_t subtree_length;
+    uint32_t height;
+    uint64_t priority;
 } segment;
 
+// Number of live snapshots of a track, shared by the track and its snapshots and freed
+// with the last of them
+typedef struct snapshot_count {
+    _Atomic uint64_t refcount;
+    _Atomic uint64_t live;
+} snapshot_count;
+
+// Low-passed versions of a track at successively halved rates, which coarse-to-fine
+// identification searches first. Levels are built as queries first need them and never
+// change after; a pyramid is replaced instead of updated once the track is edited.
+typedef struct track_pyramid {
+    _Atomic uint64_t refcount;     // the track's cache and the queries reading it
+    uint64_t epoch;                // the track version it was built from
+    uint64_t* writes;              // and the write generation of each segment's block
+    size_t segments;
+    _Atomic(struct sound_seg*) levels[PYRAMID_MAX_LEVELS];  // levels[l]: the rate halved l + 1 times
+} track_pyramid;
+
 // The main structure representing a sound track.
+// `length` caches the total sample count and is kept in sync by every edit. The public
+// functions count in frames of `channels` interleaved samples and convert at the edge;
+// everything below them counts samples, and every cut falls on a frame boundary.
+// Segment and span headers come from the track's own slab pools; either of them may
+// outlive the track in another track's tree and is returned to its pool when freed.
+// After every edit the writer publishes its tree as the version tr_snapshot hands out.
+// Readers announce themselves in the counter of the current epoch while they take a
+// reference. The writer drops the previous version once that counter drains, at once if
+// it already has and otherwise at its next publish, so it never waits on a reader.
+// The pyramid is a cache that reads may fill in, under its lock.
 typedef struct sound_seg {
-    segment *head;
+    segment *root;
+    size_t length;
+    slab_pool* segments;
+    slab_pool* spans;
+    _Atomic(segment*) published;
+    _Atomic uint64_t epoch;
+    _Atomic uint64_t readers[2];
+    segment* retired;          // the previous version, while readers may still load it
+    uint64_t retired_epoch;
+    bool failed;               // a shared node could not be copied during the current edit
+    _Atomic bool copying;      // tr_compact is copying samples, which snapshots wait out
+    bool snapshot;             // a read-only version returned by tr_snapshot
+    snapshot_count* snapshots;
+    uint16_t channels;         // samples per frame, stored interleaved
+    uint32_t sample_rate;
+    spinlock pyramid_lock;
+    track_pyramid* pyramid;
 } sound_seg;
 
+// Process-wide event counters, kept with -DSOUND_SEG_STATS and reported by tr_counters_get
+typedef struct stat_counters {
+    _Atomic uint64_t splits;
+    _Atomic uint64_t allocations;
+    _Atomic uint64_t lookups;
+    _Atomic uint64_t offsets;
+} stat_counters;
+
+#ifdef SOUND_SEG_STATS
+stat_counters sound_seg_counters;
+#define STAT_ADD(counter, n) \
+    atomic_fetch_add_explicit(&sound_seg_counters.counter, (n), memory_order_relaxed)
+#else
+#define STAT_ADD(counter, n) ((void)(n))
+#endif
+
+// Read the event counters, which stay 0 unless they are compiled in
+void tr_counters_get(tr_counters* out) {
+    if (!out) return;
+
+#ifdef SOUND_SEG_STATS
+    out->splits = atomic_load_explicit(&sound_seg_counters.splits, memory_order_relaxed);
+    out->allocations = atomic_load_explicit(&sound_seg_counters.allocations, memory_order_relaxed);
+    out->lookups = atomic_load_explicit(&sound_seg_counters.lookups, memory_order_relaxed);
+    out->offsets = atomic_load_explicit(&sound_seg_counters.offsets, memory_order_relaxed);
+#else
+    memset(out, 0, sizeof(*out));
+#endif
+}
+
+// Set the event counters to 0
+void tr_counters_reset() {
+#ifdef SOUND_SEG_STATS
+    atomic_store(&sound_seg_counters.splits, 0);
+    atomic_store(&sound_seg_counters.allocations, 0);
+    atomic_store(&sound_seg_counters.lookups, 0);
+    atomic_store(&sound_seg_counters.offsets, 0);
+#endif
+}
+
 // Initialize the empty sound track.
 struct sound_seg* tr_init() {
+    return tr_init_fmt(1, 8000);
+}
+
+// Initialize an empty track of the given format
+struct sound_seg* tr_init_fmt(uint16_t channels, uint32_t sample_rate) {
+    if (channels == 0) {
+        return NULL;
+    }
+
     struct sound_seg* track = (struct sound_seg*) malloc(sizeof(struct sound_seg));
     if (!track) {
         return NULL;
     }
 
-    track->head = NULL;
+    track->root = NULL;
+    track->length = 0;
+    atomic_init(&track->published, NULL);
+    atomic_init(&track->epoch, 0);
+    atomic_init(&track->readers[0], 0);
+    atomic_init(&track->readers[1], 0);
+    track->retired = NULL;
+    track->retired_epoch = 0;
+    track->failed = false;
+    atomic_init(&track->copying, false);
+    track->snapshot = false;
+    track->channels = channels;
+    track->sample_rate = sample_rate;
+    spinlock_init(&track->pyramid_lock);
+    track->pyramid = NULL;
+    track->segments = slab_pool_create(sizeof(segment));
+    track->spans = slab_pool_create(sizeof(span));
+    track->snapshots = (snapshot_count*) malloc(sizeof(snapshot_count));
+    if (track->snapshots) {
+        atomic_init(&track->snapshots->refcount, 1);
+        atomic_init(&track->snapshots->live, 0);
+    }
+    if (!track->segments || !track->spans || !track->snapshots) {
+        tr_destroy(track);
+        return NULL;
+    }
     return track;
 }
 
-// Free a segment and all associated child structures
-void destroy_seg(segment* seg) {
-    if (!seg) return;
-
-    segment_child* child = seg->children;
-    while (child) {
-        segment_child* temp_child = child;
-        child = child->next;
-        free(temp_child);
+// Create a span with one reference, as a child of `parent` if given
+static span* span_create(slab_pool* pool, span* parent) {
+    span* sp = (span*) slab_alloc(pool);
+    if (!sp) return NULL;
+    STAT_ADD(allocations, 1);
+
+    sp->parent = parent;
+    atomic_init(&sp->refcount, 1);
+    atomic_init(&sp->children, 0);
+    spinlock_init(&sp->lock);
+    coverage_init(&sp->coverage);
+    if (parent) {
+        atomic_fetch_add(&parent->refcount, 1);
+        atomic_fetch_add(&parent->children, 1);
     }
+    return sp;
+}
 
-    if (seg->block) {
-        seg->block->refcount--;
-        if (seg->block->refcount == 0) {
-            free(seg->block->data);
-            free(seg->block);
+// Drop a reference to a span, freeing it and releasing its parent with the last one
+static void span_release(span* sp) {
+    while (sp && atomic_fetch_sub(&sp->refcount, 1) == 1) {
+        span* parent = sp->parent;
+        coverage_free(&sp->coverage);
+        slab_free(sp);
+        if (parent) {
+            atomic_fetch_sub(&parent->children, 1);
         }
+        sp = parent;
     }
-
-    free(seg);
 }
 
-// Destroy a track and all its segments, releasing memory
-void tr_destroy(struct sound_seg* track) {
-    if (!track) {
-        return;
-    }
-
-    while (track->head) {
-        segment *to_delete = track->head;
-        track->head = to_delete->next;
-        destroy_seg(to_delete);
+// Withdraw a segment's cover from its parent span when it leaves the live track
+// Snapshots keep their nodes but never cover anything themselves
+static void segment_withdraw(segment* seg) {
+    // Should the parent's runs fail to grow, its samples simply stay covered
+    span* parent = seg->span->parent;
+    if (parent) {
+        spin_lock(&parent->lock);
+        coverage_remove(&parent->coverage, seg->offset, seg->offset + seg->length);
+        spin_unlock(&parent->lock);
     }
-
-    free(track);
 }
 
-// Return the total number of samples in a segment chain
-size_t segment_chain_length(segment* head) {
-    size_t total = 0;
-    while (head) {
-        total += head->length;
-        head = head->next;
+// Drop a reference to a block, freeing or unmapping it with the last one
+static void block_release(audio_block* block) {
+    if (atomic_fetch_sub(&block->refcount, 1) != 1) {
+        return;
     }
-    return total;
-}
 
-// Return the length (number of samples) of the track
-size_t tr_length(struct sound_seg* track) {
-    if (!track) {
-        return 0;
+    if (block->mapping) {
+        munmap(block->mapping, block->mapping_size);
     }
-
-    return segment_chain_length(track->head);
+    free(block);
 }
 
-// Read samples from the track into the provided destination buffer
-// Starting at position `pos`, copy up to `len` samples
-void tr_read(struct sound_seg* track, int16_t* dest, size_t pos, size_t len) {
-    size_t track_len = tr_length(track);
-    if (!track || !dest || pos >= track_len || len == 0) {
-        return;
-    }
-
-    size_t available = track_len - pos;
-    size_t to_read = (len < available) ? len : available;
+// Free a segment node, releasing its span and block
+static void destroy_seg(segment* seg) {
+    if (!seg) return;
 
-    segment* seg = track->head;
-    size_t seg_start = 0;
-    size_t dest_offset = 0;
+    span_release(seg->span);
+    block_release(seg->block);
+    slab_free(seg);
+}
 
-    while (seg && to_read > 0) {
-        size_t seg_end = seg_start + seg->length;
+// Return the number of samples stored in the subtree rooted at `node`
+static size_t tree_length(segment* node) {
+    return node ? node->subtree_length : 0;
+}
 
-        if (pos < seg_end) {
-            size_t local_offset = (pos > seg_start) ? (pos - seg_start) : 0;
-            size_t readable = seg->length - local_offset;
-            size_t chunk = (to_read < readable) ? to_read : readable;
+// Return the height of the subtree rooted at `node`
+static uint32_t tree_height(segment* node) {
+    return node ? node->height : 0;
+}
 
-            memcpy(dest + dest_offset,
-                   seg->block->data + seg->offset + local_offset,
-                   chunk * sizeof(int16_t));
+// Recompute the cached subtree length and height of `node`
+static void tree_update(segment* node) {
+    node->subtree_length = tree_length(node->left) + node->length + tree_length(node->right);
+    uint32_t left_height = tree_height(node->left);
+    uint32_t right_height = tree_height(node->right);
+    node->height = 1 + (left_height > right_height ? left_height : right_height);
+}
 
-            pos += chunk;
-            dest_offset += chunk;
-            to_read -= chunk;
-        }
+// Derive a pseudo-random treap priority from the node address
+static uint64_t tree_priority(segment* node) {
+    uint64_t x = (uint64_t)(uintptr_t)node + 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
 
-        seg_start += seg->length;
-        seg = seg->next;
-    }
+// Prepare a detached segment to be linked into a tree
+static void tree_init_node(segment* node) {
+    node->left = NULL;
+    node->right = NULL;
+    atomic_init(&node->refcount, 1);
+    node->subtree_length = node->length;
+    node->height = 1;
+    node->priority = tree_priority(node);
 }
 
-// Return the last segment in a segment chain
-segment* find_segment_tail(segment* head) {
-    while (head && head->next) {
-        head = head->next;
+// Drop a reference to a subtree, freeing the nodes no other version still uses
+static void tree_release(segment* node) {
+    while (node && atomic_fetch_sub(&node->refcount, 1) == 1) {
+        segment* right = node->right;
+        tree_release(node->left);
+        destroy_seg(node);
+        node = right;
     }
-    return head;
 }
 
-// Append a new segment to the end of the track with newly allocated audio block
-void append_segment(struct sound_seg* track, const int16_t* src, size_t len) {
-    if (!track || !src || len == 0) {
-        return;
+// Return a node the caller may change, copying it if another version shares it
+// The caller's reference moves to the result. The copy comes from the node's pool, which
+// the edit reserved up front; should it fail anyway, `*failed` is set and NULL returned,
+// and the caller keeps its reference to `node`.
+static segment* tree_own(segment* node, bool* failed) {
+    if (atomic_load(&node->refcount) == 1) {
+        return node;
     }
 
-    audio_block* block = (audio_block*) malloc(sizeof(audio_block));
-    if (!block) return;
+    segment* copy = (segment*) slab_alloc(slab_pool_of(node));
+    if (!copy) {
+        *failed = true;
+        return NULL;
+    }
+    STAT_ADD(allocations, 1);
+    copy->offset = node->offset;
+    copy->length = node->length;
+    copy->block = node->block;
+    copy->span = node->span;
+    copy->left = node->left;
+    copy->right = node->right;
+    atomic_init(&copy->refcount, 1);
+    copy->subtree_length = node->subtree_length;
+    copy->height = node->height;
+    copy->priority = node->priority;
+
+    if (copy->left) atomic_fetch_add(&copy->left->refcount, 1);
+    if (copy->right) atomic_fetch_add(&copy->right->refcount, 1);
+    atomic_fetch_add(&copy->block->refcount, 1);
+    atomic_fetch_add(&copy->span->refcount, 1);
+
+    tree_release(node);
+    return copy;
+}
 
-    block->data = (int16_t*) malloc(len * sizeof(int16_t));
-    if (!block->data) {
-        free(block);
+// Split a tree into its first `pos` samples and the rest
+// `pos` must fall on a segment boundary. If a node cannot be copied, `*failed` is set and
+// the two trees hold every node between them in no useful order, for the edit to drop.
+static void tree_split(segment* node, size_t pos, segment** left, segment** right, bool* failed) {
+    if (!node) {
+        *left = NULL;
+        *right = NULL;
         return;
     }
 
-    memcpy(block->data, src, len * sizeof(int16_t));
-    block->length = len;
-    block->refcount = 1;
-
-    segment* seg = (segment*) malloc(sizeof(segment));
-    if (!seg) {
-        free(block->data);
-        free(block);
+    segment* owned = tree_own(node, failed);
+    if (!owned) {
+        *left = node;
+        *right = NULL;
         return;
     }
+    node = owned;
 
-    seg->block = block;
-    seg->offset = 0;
-    seg->length = len;
-    seg->parent = NULL;
-    seg->children = NULL;
-    seg->refcount = 0;
-    seg->next = NULL;
-
-    if (!track->head) {
-        track->head = seg;
-    } 
+    size_t left_len = tree_length(node->left);
+    if (pos >= left_len + node->length) {
+        tree_split(node->right, pos - left_len - node->length, &node->right, right, failed);
+        *left = node;
+    }
     else {
-        segment* tail = find_segment_tail(track->head);
-        tail->next = seg;
+        tree_split(node->left, pos, left, &node->left, failed);
+        *right = node;
     }
+    tree_update(node);
 }
 
-// Write data from `src` into the track at position `pos`, up to `len` samples
-// If the write position exceeds track length, append new segments
-void tr_write(struct sound_seg* track, const int16_t* src, size_t pos, size_t len) {
-    size_t track_len = tr_length(track);
-    if (!track || !src || len == 0) {
-        return;
+// Concatenate two trees, all of `left` ordered before all of `right`
+// If a node cannot be copied, `*failed` is set and the tree that cannot be joined is
+// dropped, since the edit will be.
+static segment* tree_merge(segment* left, segment* right, bool* failed) {
+    if (!left) return right;
+    if (!right) return left;
+
+    segment* root;
+    if (left->priority > right->priority) {
+        root = tree_own(left, failed);
+        if (!root) {
+            tree_release(right);
+            return left;
+        }
+        root->right = tree_merge(root->right, right, failed);
+    }
+    else {
+        root = tree_own(right, failed);
+        if (!root) {
+            tree_release(left);
+            return right;
+        }
+        root->left = tree_merge(left, root->left, failed);
     }
+    tree_update(root);
+    return root;
+}
 
-    segment* seg = track->head;
-    size_t seg_start = 0;
-    size_t src_offset = 0;
+// Find the segment covering sample `pos` and store its starting position in `seg_start`
+static segment* tree_find(segment* node, size_t pos, size_t* seg_start) {
+    size_t base = 0;
+    STAT_ADD(lookups, 1);
 
-    while (seg && pos < track_len && len > 0) {
-        size_t seg_end = seg_start + seg->length;
+    while (node) {
+        size_t left_len = tree_length(node->left);
+        if (pos < left_len) {
+            node = node->left;
+        }
+        else if (pos < left_len + node->length) {
+            *seg_start = base + left_len;
+            return node;
+        }
+        else {
+            pos -= left_len + node->length;
+            base += left_len + node->length;
+            node = node->right;
+        }
+    }
+    return NULL;
+}
 
-        if (pos < seg_end) {
-            size_t local_offset = (pos > seg_start) ? (pos - seg_start) : 0;
-            size_t available = seg->length - local_offset;
-            size_t to_write = (len < available) ? len : available;
+// Return the segment after `seg`, which starts at `*seg_start`, and advance `*seg_start`
+// Nodes have no parent links, since versions share them, so this searches from the root
+static segment* tree_step(segment* root, segment* seg, size_t* seg_start) {
+    *seg_start += seg->length;
+    return tree_find(root, *seg_start, seg_start);
+}
 
-            memcpy(seg->block->data + seg->offset + local_offset,
-                   src + src_offset, to_write * sizeof(int16_t));
+// Withdraw every segment of a tree that leaves the live track
+static void tree_withdraw(segment* node) {
+    while (node) {
+        tree_withdraw(node->left);
+        segment_withdraw(node);
+        node = node->right;
+    }
+}
 
-            pos += to_write;
-            src_offset += to_write;
-            len -= to_write;
-        }
+// Reserve pool room for the node copies and new nodes of one edit, so that copying
+// shared nodes midway through a split or merge cannot run out of memory
+static bool track_reserve(struct sound_seg* track) {
+    return slab_reserve(track->segments, TREE_EDIT_PASSES * ((size_t)tree_height(track->root) + 4));
+}
 
-        seg_start += seg->length;
-        seg = seg->next;
+// Drop the version retired by the last publish once no reader that may have loaded it
+// is still taking its reference. Called before the epoch advances again, so only readers
+// already past that epoch can hold it up, and they finish within a few instructions.
+static void track_reclaim(struct sound_seg* track) {
+    if (!track->retired) {
+        return;
     }
 
-    if (len > 0) {
-        append_segment(track, src + src_offset, len);
+    int spins = 0;
+    while (atomic_load(&track->readers[track->retired_epoch & 1]) != 0) {
+        if (++spins % 64 == 0) {
+            sched_yield();
+        }
     }
+    tree_release(track->retired);
+    track->retired = NULL;
 }
 
-// Check if a segment can be deleted
-bool can_delete_segment(segment* seg) {
-    if (!seg || !seg->block) return false;
-
-    if (seg->refcount > 0) {
-        return false;
+// Give up an edit that failed to copy a node: drop the tree it was building and go back
+// to the published version, which the edit never changed since all of it was shared
+static void track_rollback(struct sound_seg* track) {
+    segment* root = atomic_load(&track->published);
+    if (root) {
+        atomic_fetch_add(&root->refcount, 1);
     }
-
-    return true;
+    tree_release(track->root);
+    track->root = root;
+    track->length = tree_length(root);
+    track->failed = false;
 }
 
-// Check if all segments are deletable
-bool can_delete_range(struct sound_seg* track, size_t pos, size_t len) {
-    size_t track_len = tr_length(track);
-    if (!track || pos >= track_len || len == 0) {
+// Publish the track's tree as the version new snapshots see, or roll the edit back if it
+// failed; returns false then. The previous version is dropped right away if no reader is
+// taking a reference to it, and otherwise retired until the next publish, so an edit
+// never waits for readers.
+static bool track_publish(struct sound_seg* track) {
+    if (track->failed) {
+        track_rollback(track);
         return false;
     }
 
-    if (pos + len > track_len) {
-        len = track_len - pos;
+    segment* root = track->root;
+    segment* old = atomic_load(&track->published);
+    if (root == old) {
+        return true;
     }
 
-    segment* seg = track->head;
-    size_t seg_start = 0;
-
-    while (seg) {
-        size_t seg_end = seg_start + seg->length;
-
-        if (seg_end > pos && seg_start < pos + len) {
-            if (!can_delete_segment(seg)) {
-                return false;
-            }
-        }
-
-        seg_start += seg->length;
-        seg = seg->next;
+    track_reclaim(track);
+    if (root) {
+        atomic_fetch_add(&root->refcount, 1);
     }
+    atomic_store(&track->published, root);
 
+    uint64_t epoch = atomic_fetch_add(&track->epoch, 1);
+    if (atomic_load(&track->readers[epoch & 1]) == 0) {
+        tree_release(old);
+    }
+    else {
+        track->retired = old;
+        track->retired_epoch = epoch;
+    }
     return true;
 }
 
-// Add child reference to parent's children list
-void add_child_to_parent(segment* parent, segment* child) {
-    if (!parent || !child) return;
-
-    segment_child* new_child = (segment_child*) malloc(sizeof(segment_child));
-    if (!new_child) return;
-
-    new_child->child = child;
-    new_child->next = parent->children;
-    parent->children = new_child;
+// Drop a reference to a snapshot count, freeing it with the last one
+static void snapshot_count_release(snapshot_count* count) {
+    if (count && atomic_fetch_sub(&count->refcount, 1) == 1) {
+        free(count);
+    }
 }
 
-// Remove a segment from its parent's child list
-void remove_child_from_parent(segment* seg) {
-    if (!seg || !seg->parent) return;
+// Return a read-only version of the track as of its last edit
+// Readers announce themselves in the current epoch's counter, which holds off the writer
+// from dropping the version they load until they have a reference. The only wait is for
+// a copy by tr_compact that had already checked for snapshots before this one counted.
+struct sound_seg* tr_snapshot(struct sound_seg* track) {
+    if (!track) {
+        return NULL;
+    }
+
+    struct sound_seg* snap = (struct sound_seg*) calloc(1, sizeof(struct sound_seg));
+    if (!snap) {
+        return NULL;
+    }
 
-    segment_child* prev_child = NULL;
-    segment_child* child = seg->parent->children;
+    // Counted before looking for a copy: either the copy sees the count and never starts,
+    // or this sees the copy and waits for it to publish
+    snap->snapshots = track->snapshots;
+    atomic_fetch_add(&snap->snapshots->refcount, 1);
+    atomic_fetch_add(&snap->snapshots->live, 1);
+    int spins = 0;
+    while (atomic_load(&track->copying)) {
+        if (++spins % 64 == 0) {
+            sched_yield();
+        }
+    }
 
-    while (child) {
-        if (child->child == seg) {
-            if (prev_child) {
-                prev_child->next = child->next;
-            } 
-            else {
-                seg->parent->children = child->next;
-            }
-            free(child);
+    uint64_t epoch;
+    for (;;) {
+        epoch = atomic_load(&track->epoch);
+        atomic_fetch_add(&track->readers[epoch & 1], 1);
+        if (atomic_load(&track->epoch) == epoch) {
             break;
         }
-        prev_child = child;
-        child = child->next;
+        atomic_fetch_sub(&track->readers[epoch & 1], 1);
+    }
+
+    segment* root = atomic_load(&track->published);
+    if (root) {
+        atomic_fetch_add(&root->refcount, 2);
     }
+    atomic_fetch_sub(&track->readers[epoch & 1], 1);
+
+    snap->root = root;
+    snap->length = tree_length(root);
+    atomic_init(&snap->published, root);
+    atomic_init(&snap->epoch, 0);
+    atomic_init(&snap->readers[0], 0);
+    atomic_init(&snap->readers[1], 0);
+    snap->retired = NULL;
+    snap->retired_epoch = 0;
+    snap->failed = false;
+    atomic_init(&snap->copying, false);
+    snap->snapshot = true;
+    snap->channels = track->channels;
+    snap->sample_rate = track->sample_rate;
+    spinlock_init(&snap->pyramid_lock);
+    snap->pyramid = NULL;
+    return snap;
 }
 
-// Split a segment into two parts at `cut_down` offset
-void split_segment(segment* seg, size_t cut_down, segment* left_parent, segment* right_parent) {
-    if (cut_down == 0 || cut_down == seg->length) {
+// Drop a reference to a pyramid, destroying its levels with the last one
+static void track_pyramid_release(track_pyramid* pyramid) {
+    if (!pyramid || atomic_fetch_sub(&pyramid->refcount, 1) != 1) {
         return;
     }
+    for (size_t l = 0; l < PYRAMID_MAX_LEVELS; l++) {
+        tr_destroy(atomic_load(&pyramid->levels[l]));
+    }
+    free(pyramid->writes);
+    free(pyramid);
+}
 
-    segment* new_seg = (segment*) malloc(sizeof(segment));
-    if (!new_seg) return;
+// Destroy a track and all its segments, releasing memory
+void tr_destroy(struct sound_seg* track) {
+    if (!track) {
+        return;
+    }
 
-    *new_seg = *seg;
-    new_seg->length -= cut_down;
-    new_seg->offset += cut_down;
-    seg->block->refcount += 1;
-    seg->length = cut_down;
-    seg->next = new_seg;
+    if (!track->snapshot) {
+        tree_withdraw(track->root);
+    }
+    tree_release(track->root);
+    tree_release(atomic_load(&track->published));
+    track_reclaim(track);
+    slab_pool_release(track->segments);
+    slab_pool_release(track->spans);
+    if (track->snapshot) {
+        atomic_fetch_sub(&track->snapshots->live, 1);
+    }
+    snapshot_count_release(track->snapshots);
+    track_pyramid_release(track->pyramid);
+    free(track);
+}
 
-    seg->parent = left_parent;
-    new_seg->parent = right_parent;
+// Return the number of samples of the track, counting every channel
+static size_t track_samples(const struct sound_seg* track) {
+    return track ? track->length : 0;
+}
 
-    if (left_parent) {
-        add_child_to_parent(left_parent, seg);
+// Convert a frame count or position of a track to samples, saturating on overflow so
+// that out-of-range arguments stay out of range
+static size_t track_frames_to_samples(const struct sound_seg* track, size_t frames) {
+    if (frames > SIZE_MAX / track->channels) {
+        return SIZE_MAX;
     }
+    return frames * track->channels;
+}
 
-    if (right_parent) {
-        add_child_to_parent(right_parent, new_seg);
+// Return the length (number of frames) of the track
+size_t tr_length(struct sound_seg* track) {
+    if (!track) {
+        return 0;
     }
 
-    segment_child* children = seg->children;
-    seg->children = NULL;
-    new_seg->children = NULL;
+    return track->length / track->channels;
+}
 
-    segment_child* seg_child = children;
-    while (seg_child) {
-        split_segment(seg_child->child, cut_down, seg, new_seg);
-        seg_child = seg_child->next;
-    }
+// Return the number of interleaved channels of the track
+uint16_t tr_channels(const struct sound_seg* track) {
+    return track ? track->channels : 0;
+}
 
-    segment_child* temp_child;
-    while (children) {
-        temp_child = children;
-        children = children->next;
-        free(temp_child);
-    }    
+// Return the sample rate the track was created or loaded with
+uint32_t tr_sample_rate(const struct sound_seg* track) {
+    return track ? track->sample_rate : 0;
 }
 
-// Ensure a recursive split is performed at the root segment level
-void recursive_split(segment* seg, size_t cut_down) {
-    while (seg->parent) {
-        seg = seg->parent;
+// Tally of the segments of one walked tree that reference a block
+typedef struct stats_block {
+    audio_block* block;
+    size_t nodes;
+    size_t shared_samples;     // samples held through a shared node or covered by copies
+    size_t copied_samples;     // the other samples of segments inserted from elsewhere
+} stats_block;
+
+// Open-addressing table of the blocks met by a tr_stats walk
+typedef struct stats_walk {
+    stats_block* table;
+    size_t mask;
+    tr_track_stats* out;
+} stats_walk;
+
+// Count the nodes of a subtree
+static size_t tree_count(segment* node) {
+    size_t count = 0;
+    while (node) {
+        count += 1 + tree_count(node->left);
+        node = node->right;
     }
+    return count;
+}
 
-    split_segment(seg, cut_down, NULL, NULL);
+// Return the tally of a block, adding an empty one the first time it is met
+static stats_block* stats_block_find(stats_walk* walk, audio_block* block) {
+    size_t i = (size_t)(((uintptr_t)block >> 6) * 0x9e3779b97f4a7c15ULL) & walk->mask;
+    while (walk->table[i].block && walk->table[i].block != block) {
+        i = (i + 1) & walk->mask;
+    }
+    walk->table[i].block = block;
+    return &walk->table[i];
 }
 
-// Delete a range of samples from a track if safe
-bool tr_delete_range(struct sound_seg* track, size_t pos, size_t len) {
-    size_t track_len = tr_length(track);
+// Tally every segment of a subtree. A node referenced more than `expected` times is
+// also part of another version, and so is everything below it.
+static void stats_walk_tree(stats_walk* walk, segment* node, uint64_t expected, bool shared) {
+    tr_track_stats* out = walk->out;
+    while (node) {
+        shared = shared || atomic_load(&node->refcount) > expected;
+        out->segments++;
+
+        size_t depth = 0;
+        for (span* sp = node->span->parent; sp; sp = sp->parent) {
+            depth++;
+        }
+        if (depth > out->span_depth) {
+            out->span_depth = depth;
+        }
+        if (depth > 0) {
+            out->copied_segments++;
+        }
 
-    if (!track || pos >= track_len || len == 0) {
-        return false;
+        size_t covered = node->length;
+        if (!shared) {
+            spin_lock(&node->span->lock);
+            covered = coverage_covered(&node->span->coverage, node->offset, node->offset + node->length);
+            spin_unlock(&node->span->lock);
+        }
+
+        stats_block* entry = stats_block_find(walk, node->block);
+        entry->nodes++;
+        out->bytes_owned += node->length * sizeof(int16_t);
+        entry->shared_samples += covered;
+        if (depth > 0) {
+            entry->copied_samples += node->length - covered;
+        }
+
+        stats_walk_tree(walk, node->left, 1, shared);
+        node = node->right;
+        expected = 1;
     }
+}
 
-    if (!can_delete_range(track, pos, len)) {
+// Walk the segment tree, tallying its blocks in a table at most half full
+// Copied samples are shared while their block has references from outside this tree
+bool tr_stats(const struct sound_seg* track, tr_track_stats* out) {
+    if (!track || !out) {
         return false;
     }
 
-    if (pos + len > track_len) {
-        len = track_len - pos;
+    memset(out, 0, sizeof(*out));
+    segment* root = track->root;
+    if (!root) {
+        return true;
     }
 
-    segment* seg = track->head;
-    segment* prev = NULL;
-    size_t cur_pos = 0;
-    
-    while (seg) {
-        size_t seg_start = cur_pos;
-        size_t seg_end = seg_start + seg->length;
+    size_t count = tree_count(root);
+    size_t slots = 2;
+    while (slots < 2 * count) {
+        slots *= 2;
+    }
+    stats_walk walk = { (stats_block*) calloc(slots, sizeof(stats_block)), slots - 1, out };
+    if (!walk.table) {
+        return false;
+    }
 
-        segment* to_delete = NULL;
+    // The track's own reference and its published version's both point at the root
+    uint64_t expected = (atomic_load(&track->published) == root) ? 2 : 1;
+    stats_walk_tree(&walk, root, expected, false);
+    out->tree_height = tree_height(root);
 
-        if (pos < seg_end && pos + len > seg_start) {
-            size_t del_start = (pos > seg_start) ? (pos - seg_start) : 0;
-            size_t del_end = ((pos + len) < seg_end) ? (pos + len - seg_start) : seg->length;
-    
-            recursive_split(seg, del_end);
-            recursive_split(seg, del_start);
+    for (size_t i = 0; i < slots; i++) {
+        const stats_block* entry = &walk.table[i];
+        audio_block* block = entry->block;
+        if (!block) {
+            continue;
+        }
 
-            while (prev && prev->next != seg) {
-                prev = prev->next;
-            }
-    
-            if (del_start == 0) {
-                if (prev) {
-                    prev->next = seg->next;
-                } 
-                else {
-                    track->head = seg->next;
-                }
-                to_delete = seg;
-            } 
+        size_t shared = entry->shared_samples;
+        if (atomic_load(&block->refcount) > entry->nodes) {
+            shared += entry->copied_samples;
         }
-        if (to_delete) {
-            if (to_delete->parent) {
-                to_delete->parent->refcount -= 1;
-            }
-            cur_pos += seg->length;
-            seg = seg->next;
-            remove_child_from_parent(to_delete);
-            destroy_seg(to_delete);
+        out->blocks++;
+        out->bytes_shared += shared * sizeof(int16_t);
+        out->bytes_owned -= shared * sizeof(int16_t);
+        if (block->mapping) {
+            out->mapped_blocks++;
+            out->bytes_allocated += block->mapping_size;
         }
         else {
-            cur_pos += seg->length;
-            prev = seg;
-            seg = seg->next;
+            out->bytes_allocated += block->capacity * sizeof(int16_t);
         }
     }
-        
+
+    free(walk.table);
     return true;
 }
 
-// Search for segments in `target` that match the given `ad` segment using correlation
-char* tr_identify(const struct sound_seg* target, const struct sound_seg* ad) {
-    size_t target_len = tr_length((struct sound_seg*)target);
-    size_t ad_len = tr_length((struct sound_seg*)ad);
-    if (!target || !ad || target_len == 0 || ad_len == 0 || 
-        ad_len > target_len || !target->head || !ad->head) {
-        char* empty = malloc(1);
-        if (empty) {
-            empty[0] = '\0';
-        }
-        return empty;
-    }
-    
-    double reference = 0.0;
-
-    const int16_t* target_data = target->head->block->data;
-    const int16_t* ad_data = ad->head->block->data;
-    
-    for (size_t i = 0; i < ad_len; i++) {
-        reference += (double)ad_data[i] * (double)ad_data[i];
-    }
-    reference = reference / ad_len;
-    
-    char* results = NULL;
-    size_t result_buffer_size = 0;
-    size_t result_length = 0;
-    bool first_result = true;
-    
-    for (size_t pos = 0; pos + ad_len <= target_len; pos++) {
-        double correlation = 0.0;
-        const int16_t* target_segment = target_data + pos;
-        
-        for (size_t i = 0; i < ad_len; i++) {
-            correlation += (double)target_segment[i] * (double)ad_data[i];
-        }
-        correlation = correlation / ad_len;
-        
-        if (correlation >= 0.95 * reference) {
-            size_t end_pos = pos + ad_len - 1;
-            char temp_buffer[64];
-            int length;
-            
-            if (first_result) {
-                length = snprintf(temp_buffer, sizeof(temp_buffer), "%zu,%zu", pos, end_pos);
-                first_result = false;
-            } else {
-                length = snprintf(temp_buffer, sizeof(temp_buffer), "\n%zu,%zu", pos, end_pos);
-            }
-            
-            size_t new_length = result_length + length;
-            if (new_length >= result_buffer_size) {
-                size_t new_size = result_buffer_size == 0 ? 128 : result_buffer_size * 2;
-                while (new_size <= new_length) {
-                    new_size *= 2;
-                }
-                
-                char* new_buffer = (char*)realloc(results, new_size);
-                if (!new_buffer) {
-                    free(results);
-
-                    char* empty = malloc(1);
-                    if (empty) {
-                        empty[0] = '\0';
-                    }
-                    return empty;
-                }
-                
-                results = new_buffer;
-                result_buffer_size = new_size;
-            }
-            
-            memcpy(results + result_length, temp_buffer, length);
-            result_length += length;
-            results[result_length] = '\0';
-            
-            pos = end_pos;
-        }
+// Read samples from the track into the provided destination buffer
+// Starting at sample `pos`, copy up to `len` samples
+static void track_read(const struct sound_seg* track, int16_t* dest, size_t pos, size_t len) {
+    size_t track_len = track_samples(track);
+    if (!track || !dest || pos >= track_len || len == 0) {
+        return;
     }
-    
-    if (!results) {
-        char* empty = malloc(1);
-        if (empty) {
-            empty[0] = '\0';
-        }
-        return empty;
+
+    size_t available = track_len - pos;
+    size_t to_read = (len < available) ? len : available;
+
+    size_t seg_start = 0;
+    segment* seg = tree_find(track->root, pos, &seg_start);
+    size_t local_offset = pos - seg_start;
+    size_t dest_offset = 0;
+
+    while (seg && to_read > 0) {
+        size_t readable = seg->length - local_offset;
+        size_t chunk = (to_read < readable) ? to_read : readable;
+
+        memcpy(dest + dest_offset,
+               seg->block->data + seg->offset + local_offset,
+               chunk * sizeof(int16_t));
+
+        dest_offset += chunk;
+        to_read -= chunk;
+        local_offset = 0;
+        seg = tree_step(track->root, seg, &seg_start);
     }
-    
-    return results;
 }
 
-// Extract a shared segment chain from src_track starting at srcpos with length len
-segment* extract_segment_slice(struct sound_seg* src_track, size_t srcpos, size_t len) {
-    size_t track_len = tr_length(src_track);
-    if (!src_track || len == 0 || srcpos + len > track_len) {
-        return NULL;
+// Read frames [pos, pos + len) of the track into `dest`, interleaved
+void tr_read(struct sound_seg* track, int16_t* dest, size_t pos, size_t len) {
+    if (!track) {
+        return;
     }
 
-    segment* seg = src_track->head;
-    size_t cur_pos = 0;
-    segment* result_head_final = NULL;
+    track_read(track, dest, track_frames_to_samples(track, pos), track_frames_to_samples(track, len));
+}
 
-    while (seg && len > 0) {
-        size_t seg_start = cur_pos;
-        size_t seg_end = seg_start + seg->length;
+// Start iterating over the samples [pos, pos + len) of a track
+static void track_span_begin(tr_span_iter* it, const struct sound_seg* track, size_t pos, size_t len) {
+    size_t track_len = track_samples(track);
 
-        if (srcpos >= seg_end) {
-            cur_pos += seg->length;
-            seg = seg->next;
-            continue;
-        }
+    it->track = track;
+    it->pos = (pos < track_len) ? pos : track_len;
+    it->end = (len < track_len - it->pos) ? it->pos + len : track_len;
+}
 
-        size_t local_start = (srcpos > seg_start) ? (srcpos - seg_start) : 0;
-        size_t available = seg->length - local_start;
-        size_t take = (len < available) ? len : available;
+// Return the next contiguous run of samples in place and store its length in `len`
+static const int16_t* track_span_next(tr_span_iter* it, size_t* len) {
+    if (!it->track || it->pos >= it->end) {
+        *len = 0;
+        return NULL;
+    }
 
-        recursive_split(seg, local_start + take);
-        recursive_split(seg, local_start);
+    size_t seg_start = 0;
+    segment* seg = tree_find(it->track->root, it->pos, &seg_start);
+    size_t local_offset = it->pos - seg_start;
+    size_t run = seg->length - local_offset;
+    if (run > it->end - it->pos) {
+        run = it->end - it->pos;
+    }
 
-        if (local_start == 0) {
-            segment* new_seg = (segment*) malloc(sizeof(segment));
-            if (!new_seg) return NULL;
+    it->pos += run;
+    *len = run;
+    return seg->block->data + seg->offset + local_offset;
+}
 
-            *new_seg = *seg;
-            add_child_to_parent(seg, new_seg);
-            new_seg->children = NULL;
-            new_seg->parent = seg;
-            new_seg->refcount = 0;
-            new_seg->next = NULL;
-            seg->refcount +=1;
-            seg->block->refcount += 1;
+// Start iterating over frames [pos, pos + len) of a track
+void tr_span_begin(tr_span_iter* it, const struct sound_seg* track, size_t pos, size_t len) {
+    if (!track) {
+        it->track = NULL;
+        it->pos = 0;
+        it->end = 0;
+        return;
+    }
 
-            segment* tail = find_segment_tail(result_head_final);
-            if (!tail) {
-                result_head_final = new_seg;
-            }
-            else {
-                tail->next = new_seg;
-            }
+    track_span_begin(it, track, track_frames_to_samples(track, pos), track_frames_to_samples(track, len));
+}
 
-            len -= take;
-            srcpos += take;
-        }
-        cur_pos += seg->length;
-        seg = seg->next;
+// Return the next run of whole frames; segments are always cut between frames
+const int16_t* tr_span_next(tr_span_iter* it, size_t* len) {
+    const int16_t* run = track_span_next(it, len);
+    if (run) {
+        *len /= it->track->channels;
     }
-    return result_head_final;
+    return run;
 }
 
-// Insert the given segment chain into the track at destpos
-bool insert_segment_chain(struct sound_seg* track, size_t destpos, segment* insert_chain) {
-    size_t track_len = tr_length(track);
-    if (!track || !insert_chain || destpos > track_len) {
-        return false;
+// Allocate an audio block with room for at least `capacity` samples
+static audio_block* block_create(size_t capacity) {
+    if (capacity < BLOCK_MIN_CAPACITY) {
+        capacity = BLOCK_MIN_CAPACITY;
     }
 
-    segment* seg = track->head;
-    segment* prev = NULL;
-    size_t cur_pos = 0;
+    size_t size = sizeof(audio_block) + capacity * sizeof(int16_t);
+    size = (size + BLOCK_ALIGN - 1) / BLOCK_ALIGN * BLOCK_ALIGN;
+
+    audio_block* block = (audio_block*) aligned_alloc(BLOCK_ALIGN, size);
+    if (!block) return NULL;
+    STAT_ADD(allocations, 1);
+
+    block->data = block->storage;
+    block->length = 0;
+    block->capacity = (size - sizeof(audio_block)) / sizeof(int16_t);
+    atomic_init(&block->refcount, 1);
+    atomic_init(&block->writes, 0);
+    block->mapping = NULL;
+    block->mapping_size = 0;
+    return block;
+}
+
+// Return the last segment of a tree
+static segment* tree_last(segment* node) {
+    while (node && node->right) {
+        node = node->right;
+    }
+    return node;
+}
 
-    if (destpos == 0) {
-        segment* tail = find_segment_tail(insert_chain);
-        tail->next = track->head;
-        track->head = insert_chain;
-        return true;
+// Lengthen the last segment of a tree by `len`, copying shared nodes on its spine
+// If a node cannot be copied, `*failed` is set and the rest of the spine left as it is.
+static segment* tree_grow_last(segment* node, size_t len, bool* failed) {
+    segment* owned = tree_own(node, failed);
+    if (!owned) {
+        return node;
     }
+    node = owned;
+    node->subtree_length += len;
+    if (node->right) {
+        node->right = tree_grow_last(node->right, len, failed);
+    }
+    else {
+        node->length += len;
+    }
+    return node;
+}
 
-    while (seg) {
-        size_t seg_start = cur_pos;
-        size_t seg_end = seg_start + seg->length;
+// Extend the track's last segment in place when it alone owns the end of a block with
+// `len` spare samples; returns false if a new segment is needed
+// Samples past the segment's end are invisible to snapshots, so they can be filled
+static bool append_in_place(struct sound_seg* track, const int16_t* src, size_t len) {
+    segment* tail = tree_last(track->root);
+    if (!tail) return false;
 
-        if (destpos <= seg_end) {
-            size_t local_offset = destpos - seg_start;
+    audio_block* block = tail->block;
+    if (atomic_load(&block->refcount) != 1 || tail->offset + tail->length != block->length ||
+        block->capacity - block->length < len) {
+        return false;
+    }
 
-            if (local_offset == 0) {
-                segment* tail = find_segment_tail(insert_chain);
-                if (prev) {
-                    prev->next = insert_chain;
-                } 
-                else {
-                    track->head = insert_chain;
-                }
-                tail->next = seg;
-            } 
-            else if (local_offset == seg->length) {
-                segment* tail = find_segment_tail(insert_chain);
-                tail->next = seg->next;
-                seg->next = insert_chain;
-            } 
-            else {
-                recursive_split(seg, local_offset);
-                segment* tail = find_segment_tail(insert_chain);
-                tail->next = seg->next;
-                seg->next = insert_chain;
-            }
-            return true;
-        }
+    memcpy(block->data + block->length, src, len * sizeof(int16_t));
+    block->length += len;
+    track->root = tree_grow_last(track->root, len, &track->failed);
+    track->length += len;
+    return true;
+}
 
-        cur_pos += seg->length;
-        prev = seg;
-        seg = seg->next;
+// Add a segment holding all of `block` to the end of the track, taking over the
+// caller's reference on success. The pool room must already be reserved.
+static bool append_block(struct sound_seg* track, audio_block* block) {
+    segment* seg = (segment*) slab_alloc(track->segments);
+    span* sp = span_create(track->spans, NULL);
+    if (!seg || !sp) {
+        slab_free(seg);
+        slab_free(sp);
+        return false;
     }
+    STAT_ADD(allocations, 1);
 
-    segment* tail = find_segment_tail(track->head);
-    if (tail) {
-        tail->next = insert_chain;
-    } 
-    else {
-        track->head = insert_chain;
-    }
+    seg->block = block;
+    seg->span = sp;
+    seg->offset = 0;
+    seg->length = block->length;
+    tree_init_node(seg);
+
+    track->root = tree_merge(track->root, seg, &track->failed);
+    track->length += block->length;
     return true;
 }
 
-// Insert a portion from src_track into dest_track
-void tr_insert(struct sound_seg* src_track,
-               struct sound_seg* dest_track,
-               size_t destpos, size_t srcpos, size_t len) {
-    size_t src_len = tr_length(src_track);
-    size_t dest_len = tr_length(dest_track);  
-    
-    if (!src_track || !dest_track || len == 0) {
+// Check whether a tail segment ends a block its track allocated and is filling by
+// appending: not a copy inserted from another track, not mapped from a file, and holding
+// the block's last samples. Only such a block tells how large the next one should grow.
+static bool tail_block_growing(const segment* tail) {
+    return tail->span->parent == NULL && tail->block->mapping == NULL &&
+           tail->offset + tail->length == tail->block->length;
+}
+
+// Append samples to the end of the track, filling the tail block's spare capacity when
+// possible and otherwise adding a segment with a newly allocated audio block
+// New blocks grow geometrically, so a track fed in small chunks stays a few segments long
+// and each append copies its samples once
+static void append_segment(struct sound_seg* track, const int16_t* src, size_t len) {
+    if (!track || !src || len == 0 || !track_reserve(track)) {
         return;
     }
 
-    if (srcpos + len > src_len || destpos > dest_len) {  
+    if (append_in_place(track, src, len)) {
         return;
     }
 
-    segment* ref_chain = extract_segment_slice(src_track, srcpos, len);
-    if (!ref_chain) {
-        return;
+    size_t capacity = len;
+    segment* tail = tree_last(track->root);
+    if (tail && tail_block_growing(tail)) {
+        size_t grown = tail->block->capacity * 2;
+        if (grown > BLOCK_MAX_GROWTH) {
+            grown = BLOCK_MAX_GROWTH;
+        }
+        if (grown > capacity) {
+            capacity = grown;
+        }
     }
 
+    audio_block* block = block_create(capacity);
+    if (!block) return;
+
+    memcpy(block->data, src, len * sizeof(int16_t));
+    block->length = len;
+
+    if (!append_block(track, block)) {
+        block_release(block);
+    }
+}
+
+// Write data from `src` into the track at sample `pos`, up to `len` samples
+// If the write position exceeds track length, append new segments
+static void track_write(struct sound_seg* track, const int16_t* src, size_t pos, size_t len) {
+    size_t track_len = track_samples(track);
+    if (!track || track->snapshot || !src || len == 0) {
+        return;
+    }
+
+    size_t src_offset = 0;
+
+    if (pos < track_len) {
+        size_t seg_start = 0;
+        segment* seg = tree_find(track->root, pos, &seg_start);
+        size_t local_offset = pos - seg_start;
+
+        while (seg && len > 0) {
+            size_t available = seg->length - local_offset;
+            size_t to_write = (len < available) ? len : available;
+
+            memcpy(seg->block->data + seg->offset + local_offset,
+                   src + src_offset, to_write * sizeof(int16_t));
+            atomic_fetch_add(&seg->block->writes, 1);
+
+            src_offset += to_write;
+            len -= to_write;
+            local_offset = 0;
+            seg = tree_step(track->root, seg, &seg_start);
+        }
+    }
+
+    if (len > 0) {
+        append_segment(track, src + src_offset, len);
+        track_publish(track);
+    }
+}
+
+// Write `len` interleaved frames from `src` at frame `pos`
+void tr_write(struct sound_seg* track, const int16_t* src, size_t pos, size_t len) {
+    if (!track || len > SIZE_MAX / track->channels) {
+        return;
+    }
+
+    track_write(track, src, track_frames_to_samples(track, pos), len * track->channels);
+}
+
+// Check if samples [from, from + len) of a segment can be deleted: no copy inserted
+// elsewhere may still cover them
+static bool can_delete_segment(segment* seg, size_t from, size_t len) {
+    if (!seg || !seg->block) return false;
+
+    size_t start = seg->offset + from;
+    spin_lock(&seg->span->lock);
+    bool covered = coverage_any(&seg->span->coverage, start, start + len);
+    spin_unlock(&seg->span->lock);
+    return !covered;
+}
+
+// Check if all segments are deletable
+static bool can_delete_range(struct sound_seg* track, size_t pos, size_t len) {
+    size_t track_len = track_samples(track);
+    if (!track || pos >= track_len || len == 0) {
+        return false;
+    }
+
+    if (len > track_len - pos) {
+        len = track_len - pos;
+    }
+
+    size_t seg_start = 0;
+    segment* seg = tree_find(track->root, pos, &seg_start);
+    size_t local_offset = pos - seg_start;
+
+    while (seg && len > 0) {
+        size_t available = seg->length - local_offset;
+        size_t chunk = (len < available) ? len : available;
+        if (!can_delete_segment(seg, local_offset, chunk)) {
+            return false;
+        }
+
+        len -= chunk;
+        local_offset = 0;
+        seg = tree_step(track->root, seg, &seg_start);
+    }
+
+    return true;
+}
+
+// Make `pos` fall on a segment boundary of a tree, allocating the new piece from `pool`
+// The covering segment is cut in two pieces of the same span; no other track changes.
+// Returns false if the piece cannot be allocated, leaving the tree unchanged, or if a
+// shared node cannot be copied, which also sets `*failed`.
+static bool tree_cut(segment** root, size_t pos, slab_pool* pool, bool* failed) {
+    size_t seg_start = 0;
+    segment* seg = tree_find(*root, pos, &seg_start);
+    if (!seg || pos == seg_start) {
+        return true;
+    }
+
+    segment* new_seg = (segment*) slab_alloc(pool);
+    if (!new_seg) return false;
+    STAT_ADD(allocations, 1);
+    STAT_ADD(splits, 1);
+
+    size_t cut_down = pos - seg_start;
+    segment *before, *after;
+    tree_split(*root, seg_start, &before, &after, failed);
+    tree_split(after, seg->length, &seg, &after, failed);
+    if (*failed) {
+        slab_free(new_seg);
+        *root = tree_merge(before, tree_merge(seg, after, failed), failed);
+        return false;
+    }
+
+    new_seg->offset = seg->offset + cut_down;
+    new_seg->length = seg->length - cut_down;
+    new_seg->block = seg->block;
+    new_seg->span = seg->span;
+    tree_init_node(new_seg);
+    atomic_fetch_add(&seg->block->refcount, 1);
+    atomic_fetch_add(&seg->span->refcount, 1);
+    seg->length = cut_down;
+    tree_update(seg);
+
+    *root = tree_merge(before, tree_merge(tree_merge(seg, new_seg, failed), after, failed), failed);
+    return !*failed;
+}
+
+// Make `pos` fall on a segment boundary of the track, failing the edit if it cannot
+static void split_track_at(struct sound_seg* track, size_t pos) {
+    if (!tree_cut(&track->root, pos, track->segments, &track->failed)) {
+        track->failed = true;
+    }
+}
+
+// Delete a range of frames from a track if safe
+bool tr_delete_range(struct sound_seg* track, size_t pos, size_t len) {
+    if (!track || track->snapshot) {
+        return false;
+    }
+
+    size_t track_len = track_samples(track);
+    pos = track_frames_to_samples(track, pos);
+    len = track_frames_to_samples(track, len);
+    if (pos >= track_len || len == 0) {
+        return false;
+    }
+
+    if (!can_delete_range(track, pos, len) || !track_reserve(track)) {
+        return false;
+    }
+
+    if (len > track_len - pos) {
+        len = track_len - pos;
+    }
+
+    split_track_at(track, pos);
+    split_track_at(track, pos + len);
+
+    segment *before, *middle, *after;
+    tree_split(track->root, pos, &before, &middle, &track->failed);
+    tree_split(middle, len, &middle, &after, &track->failed);
+    track->root = tree_merge(before, after, &track->failed);
+    track->length -= len;
+
+    // A failed edit leaves the segments in the track, still covering their sources
+    if (!track->failed) {
+        tree_withdraw(middle);
+    }
+    tree_release(middle);
+    return track_publish(track);
+}
+
+// Return a newly allocated empty string for identification results
+static char* empty_identify_result() {
+    char* empty = malloc(1);
+    if (empty) {
+        empty[0] = '\0';
+    }
+    return empty;
+}
+
+// Format matches as "start,end" lines, sizing the string exactly before writing it
+static char* format_matches(const tr_match* matches, size_t count) {
+    size_t total = 1;
+    for (size_t i = 0; i < count; i++) {
+        total += snprintf(NULL, 0, "\n%zu,%zu", matches[i].start, matches[i].end);
+    }
+
+    char* results = (char*) malloc(total);
+    if (!results) {
+        return NULL;
+    }
+
+    size_t length = 0;
+    results[0] = '\0';
+    for (size_t i = 0; i < count; i++) {
+        length += snprintf(results + length, total - length, i == 0 ? "%zu,%zu" : "\n%zu,%zu",
+                           matches[i].start, matches[i].end);
+    }
+    return results;
+}
+
+// Apply the identification threshold to the exact dot product of a window and the ad
+static bool correlation_matches(int64_t dot, size_t ad_len, double reference) {
+    double correlation = (double)dot / ad_len;
+    return correlation >= 0.95 * reference;
+}
+
+// Normalized correlation of a window: its correlation with the ad relative to the ad's
+// own, so the identification threshold is a score of 0.95
+static double match_score(int64_t dot, size_t ad_len, double reference) {
+    if (reference == 0.0) {
+        return 1.0;
+    }
+    return ((double)dot / ad_len) / reference;
+}
+
+// Matches collected by a sequential identification, either into a fixed array that only
+// counts matches past its capacity, or into an array that grows as needed
+typedef struct match_sink {
+    tr_match* matches;
+    size_t count;              // matches found, which may exceed capacity
+    size_t capacity;
+    bool growable;
+    size_t ad_len;
+    double reference;
+    size_t channels;           // matches are reported in frames of this many samples
+} match_sink;
+
+// Record a match starting at sample `start` with the given score
+static bool match_sink_record(match_sink* sink, size_t start, double score) {
+    if (sink->count == sink->capacity && sink->growable) {
+        size_t new_cap = sink->capacity == 0 ? 16 : sink->capacity * 2;
+        tr_match* new_matches = (tr_match*) realloc(sink->matches, new_cap * sizeof(tr_match));
+        if (!new_matches) return false;
+
+        sink->matches = new_matches;
+        sink->capacity = new_cap;
+    }
+
+    if (sink->count < sink->capacity) {
+        tr_match* match = &sink->matches[sink->count];
+        match->start = start / sink->channels;
+        match->end = (start + sink->ad_len) / sink->channels - 1;
+        match->score = score;
+    }
+    sink->count++;
+    return true;
+}
+
+// Record a match starting at sample `start` whose window has dot product `dot` with the ad
+static bool match_sink_add(match_sink* sink, size_t start, int64_t dot) {
+    return match_sink_record(sink, start, match_score(dot, sink->ad_len, sink->reference));
+}
+
+// Apply the threshold to an FFT estimate, falling back to the exact dot product
+// whenever the estimate lies within its error bound of the threshold
+static bool estimate_matches(double estimate, double margin, const int16_t* window,
+                      const int16_t* ad_data, size_t ad_len, double reference, dot_kernel dot) {
+    double threshold = 0.95 * reference * ad_len;
+    margin += (threshold < 0 ? -threshold : threshold) * 1e-12;
+
+    if (estimate - margin > threshold) {
+        return true;
+    }
+    if (estimate + margin < threshold) {
+        return false;
+    }
+    return correlation_matches(dot(window, ad_data, ad_len), ad_len, reference);
+}
+
+// Return the samples of an ad track, read in place when the track is one contiguous run
+// and otherwise gathered once into `*copy`, which the caller frees
+static const int16_t* identify_ad_samples(const struct sound_seg* ad, size_t ad_len, int16_t** copy) {
+    tr_span_iter it;
+    size_t run_len = 0;
+    track_span_begin(&it, ad, 0, ad_len);
+    const int16_t* data = track_span_next(&it, &run_len);
+
+    *copy = NULL;
+    if (run_len < ad_len) {
+        *copy = (int16_t*) malloc(ad_len * sizeof(int16_t));
+        if (!*copy) return NULL;
+        track_read(ad, *copy, 0, ad_len);
+        data = *copy;
+    }
+    return data;
+}
+
+// Shared read-only description of one identification
+typedef struct identify_job {
+    const struct sound_seg* target;
+    size_t target_len;
+    const int16_t* ad_data;    // points into the ad track, or into ad_copy if it is fragmented
+    int16_t* ad_copy;
+    size_t ad_len;
+    size_t offsets;            // number of candidate window positions
+    size_t channels;           // only every channels-th position starts a frame
+    double reference;
+    double threshold;          // least dot product of a match, in the default mode
+    uint64_t least_energy;     // least energy of a window that can reach it
+    bool normalized;           // match by normalized cross-correlation instead
+    bool relaxed;              // the coarse pass of a coarse-to-fine identification
+    double ncc_threshold;
+    uint64_t* ad_rest;         // energy of the ad from each IDENTIFY_PRUNE_CHUNK on
+    int64_t ad_sum;
+    double ad_deviation;       // energy of the ad about its mean
+    dot_kernel dot;
+    xcorr_plan* plan;          // NULL when the ad is correlated directly
+} identify_job;
+
+// Release the buffers owned by an identification
+static void identify_job_release(identify_job* job) {
+    xcorr_plan_destroy(job->plan);
+    free(job->ad_rest);
+    free(job->ad_copy);
+}
+
+// Return the least energy of a window whose dot product with an ad of energy `ad_energy`
+// can reach `threshold`. Cauchy–Schwarz bounds the dot product by the root of the product
+// of their energies, so quieter windows cannot match; rounded down to stay on the safe side.
+static uint64_t identify_least_energy(double threshold, uint64_t ad_energy) {
+    if (threshold <= 0.0 || ad_energy == 0) {
+        return 0;
+    }
+    return (uint64_t)(threshold * threshold * (1.0 - 1e-9) / (double)ad_energy);
+}
+
+// Set up an identification; returns false if there is nothing to search
+// Samples are correlated as stored, interleaved: at an offset that starts a frame, the
+// dot product of the interleaved ad and window is the sum of the per-channel ones, so
+// the kernels and transforms run over contiguous memory without deinterleaving
+static bool identify_job_init(identify_job* job, const struct sound_seg* target, const struct sound_seg* ad,
+                       const tr_identify_opts* opts) {
+    size_t target_len = track_samples(target);
+    size_t ad_len = track_samples(ad);
+    if (!target || !ad || target->channels != ad->channels || target_len == 0 || ad_len == 0 ||
+        ad_len > target_len) {
+        return false;
+    }
+
+    job->target = target;
+    job->target_len = target_len;
+    job->ad_len = ad_len;
+    job->offsets = target_len - ad_len + 1;
+    job->channels = target->channels;
+    job->normalized = opts && opts->normalized;
+    job->relaxed = false;
+    job->ncc_threshold = (opts && opts->threshold > 0.0) ? opts->threshold : 0.95;
+    job->ad_copy = NULL;
+    job->ad_rest = NULL;
+    job->plan = NULL;
+
+    job->ad_data = identify_ad_samples(ad, ad_len, &job->ad_copy);
+    if (!job->ad_data) {
+        return false;
+    }
+
+    job->dot = dot_kernel_select(NULL);
+    job->reference = (double)job->dot(job->ad_data, job->ad_data, ad_len) / ad_len;
+    job->threshold = 0.95 * job->reference * ad_len;
+
+    // Suffix energies at every chunk boundary, for the bound on a partial dot product
+    size_t chunks = ad_len / IDENTIFY_PRUNE_CHUNK;
+    job->ad_rest = (uint64_t*) malloc((chunks + 1) * sizeof(uint64_t));
+    if (!job->ad_rest) {
+        identify_job_release(job);
+        return false;
+    }
+    job->ad_sum = 0;
+    uint64_t energy = 0;
+    for (size_t k = ad_len; k-- > 0;) {
+        int64_t sample = job->ad_data[k];
+        energy += (uint64_t)(sample * sample);
+        job->ad_sum += sample;
+        if (k % IDENTIFY_PRUNE_CHUNK == 0) {
+            job->ad_rest[k / IDENTIFY_PRUNE_CHUNK] = energy;
+        }
+    }
+    job->ad_deviation = (double)energy - (double)job->ad_sum * (double)job->ad_sum / ad_len;
+    job->least_energy = identify_least_energy(job->threshold, energy);
+    if (job->normalized && job->ad_deviation <= 0.0) {
+        identify_job_release(job);
+        return false;
+    }
+
+    if (ad_len >= IDENTIFY_FFT_MIN_AD) {
+        job->plan = xcorr_plan_create(job->ad_data, ad_len);
+        if (!job->plan) {
+            identify_job_release(job);
+            return false;
+        }
+    }
+    return true;
+}
+
+// Lower the thresholds of a job to `fraction` of themselves, for a pass whose matches are
+// only candidates for an exact one
+static void identify_job_relax(identify_job* job, double fraction) {
+    job->relaxed = true;
+    job->threshold *= fraction;
+    job->ncc_threshold *= fraction;
+    job->least_energy = identify_least_energy(job->threshold, job->ad_rest[0]);
+}
+
+// The contiguous run of the target that a scan last looked at
+typedef struct target_cursor {
+    const struct sound_seg* track;
+    size_t start;
+    size_t end;
+    const int16_t* data;
+} target_cursor;
+
+// Make the cursor cover the run containing `pos`
+static void target_cursor_seek(target_cursor* cur, size_t pos) {
+    if (pos >= cur->start && pos < cur->end) {
+        return;
+    }
+
+    tr_span_iter it;
+    size_t run_len = 0;
+    track_span_begin(&it, cur->track, pos, track_samples(cur->track) - pos);
+    cur->data = track_span_next(&it, &run_len);
+    cur->start = pos;
+    cur->end = pos + run_len;
+}
+
+// Return `len` contiguous target samples from `pos`, read in place when they lie in one
+// run and gathered into `scratch` when the window crosses a segment boundary
+static const int16_t* target_window(target_cursor* cur, size_t pos, size_t len, int16_t* scratch) {
+    target_cursor_seek(cur, pos);
+    if (pos + len <= cur->end) {
+        return cur->data + (pos - cur->start);
+    }
+
+    track_read(cur->track, scratch, pos, len);
+    return scratch;
+}
+
+// Dot product of the ad with the target window at `pos`, summed run by run
+static int64_t target_window_dot(target_cursor* cur, size_t pos, const int16_t* ad_data,
+                          size_t ad_len, dot_kernel dot) {
+    target_cursor_seek(cur, pos);
+    if (pos + ad_len <= cur->end) {
+        return dot(cur->data + (pos - cur->start), ad_data, ad_len);
+    }
+
+    int64_t sum = 0;
+    size_t done = 0;
+    size_t run_len = 0;
+    const int16_t* run;
+    tr_span_iter it;
+    track_span_begin(&it, cur->track, pos, ad_len);
+    while ((run = track_span_next(&it, &run_len))) {
+        sum += dot(run, ad_data + done, run_len);
+        done += run_len;
+    }
+    return sum;
+}
+
+// Return the square root of x >= 0 by Newton's method, without depending on libm
+static double identify_sqrt(double x) {
+    if (!(x > 0.0)) {
+        return 0.0;
+    }
+
+    // Halving the exponent bits gives a first guess within about 6%
+    uint64_t bits;
+    memcpy(&bits, &x, sizeof(bits));
+    bits = (bits >> 1) + ((uint64_t)0x3ff << 51);
+    double root;
+    memcpy(&root, &bits, sizeof(root));
+    for (int k = 0; k < 6; k++) {
+        root = 0.5 * (root + x / root);
+    }
+    return root;
+}
+
+// Prefix sums over the target samples of one block, giving the energy and sum of any
+// window in O(1). They are rebuilt per block so their memory stays bounded.
+typedef struct window_sums {
+    uint64_t* squares;         // squares[k]: energy of the first k samples
+    int64_t* sums;             // sums[k]: sum of the first k samples, in the normalized mode
+    size_t len;                // window length
+} window_sums;
+
+// Fill the prefix sums of `count` samples
+static void window_sums_fill(window_sums* ws, const int16_t* samples, size_t count) {
+    uint64_t square = 0;
+    ws->squares[0] = 0;
+    for (size_t k = 0; k < count; k++) {
+        square += (uint64_t)((int32_t)samples[k] * samples[k]);
+        ws->squares[k + 1] = square;
+    }
+    if (ws->sums) {
+        int64_t sum = 0;
+        ws->sums[0] = 0;
+        for (size_t k = 0; k < count; k++) {
+            sum += samples[k];
+            ws->sums[k + 1] = sum;
+        }
+    }
+}
+
+// Return the energy of the window starting at block offset `i`, from sample `from` of it on
+static uint64_t window_energy(const window_sums* ws, size_t i, size_t from) {
+    return ws->squares[i + ws->len] - ws->squares[i + from];
+}
+
+// Return the product of the deviations about their means of the window at `i` and the ad,
+// which the normalized cross-correlation divides by; <= 0 when the window is constant
+static double identify_deviations(const identify_job* job, const window_sums* ws, size_t i) {
+    double sum = (double)(ws->sums[i + ws->len] - ws->sums[i]);
+    double deviation = (double)window_energy(ws, i, 0) - sum * sum / ws->len;
+    return deviation * job->ad_deviation;
+}
+
+// Return what the dot product of window and ad contributes to their covariance only
+// through their means, which the normalized mode subtracts
+static double identify_mean_product(const identify_job* job, const window_sums* ws, size_t i) {
+    return (double)(ws->sums[i + ws->len] - ws->sums[i]) * (double)job->ad_sum / ws->len;
+}
+
+// Check whether the window at `i` can match at all, without a dot product: in the default
+// mode it must be loud enough, and in the normalized one it must not be constant
+static bool identify_possible(const identify_job* job, const window_sums* ws, size_t i) {
+    if (job->normalized) {
+        return identify_deviations(job, ws, i) > 0.0;
+    }
+    return window_energy(ws, i, 0) >= job->least_energy;
+}
+
+// Return the least dot product of a match at `i`
+static double identify_threshold(const identify_job* job, const window_sums* ws, size_t i) {
+    if (!job->normalized) {
+        return job->threshold;
+    }
+    return identify_mean_product(job, ws, i) +
+           job->ncc_threshold * identify_sqrt(identify_deviations(job, ws, i));
+}
+
+// Apply the exact test to the window at `i`, given its dot product
+static bool identify_accepts(const identify_job* job, const window_sums* ws, size_t i, int64_t dot) {
+    if (!job->normalized) {
+        if (job->relaxed) {
+            return (double)dot >= job->threshold;
+        }
+        return correlation_matches(dot, job->ad_len, job->reference);
+    }
+    double covariance = (double)dot - identify_mean_product(job, ws, i);
+    return covariance >= 0.0 &&
+           covariance * covariance >= job->ncc_threshold * job->ncc_threshold * identify_deviations(job, ws, i);
+}
+
+// Return the score reported for a match at `i`
+static double identify_score(const identify_job* job, const window_sums* ws, size_t i, int64_t dot) {
+    if (!job->normalized) {
+        return match_score(dot, job->ad_len, job->reference);
+    }
+    double covariance = (double)dot - identify_mean_product(job, ws, i);
+    return covariance / identify_sqrt(identify_deviations(job, ws, i));
+}
+
+// Check whether an FFT estimate of the dot product at `i` rules out a match, even when
+// it is off by its whole error bound
+static bool identify_estimate_rejects(const identify_job* job, const window_sums* ws, size_t i,
+                               double estimate, double margin) {
+    if (!job->normalized) {
+        double threshold = job->threshold;
+        return estimate + margin + (threshold < 0 ? -threshold : threshold) * 1e-9 < threshold;
+    }
+    double mean_product = identify_mean_product(job, ws, i);
+    double covariance = estimate + margin + (mean_product < 0 ? -mean_product : mean_product) * 1e-9 + 1.0 -
+                        mean_product;
+    return covariance < 0.0 ||
+           covariance * covariance < job->ncc_threshold * job->ncc_threshold * identify_deviations(job, ws, i) *
+                                     (1.0 - 1e-9);
+}
+
+// Compute the exact dot product of the window at `i` a chunk at a time, giving up as soon
+// as Cauchy–Schwarz on the samples left shows that it cannot reach the threshold
+static bool identify_direct(const identify_job* job, const window_sums* ws, size_t i,
+                     const int16_t* window, int64_t* dot) {
+    size_t ad_len = job->ad_len;
+    if (ad_len <= IDENTIFY_PRUNE_CHUNK) {
+        *dot = job->dot(window, job->ad_data, ad_len);
+        return identify_accepts(job, ws, i, *dot);
+    }
+
+    double threshold = identify_threshold(job, ws, i);
+    double lowest = threshold - (threshold < 0 ? -threshold : threshold) * 1e-9 - 1.0;
+
+    int64_t partial = 0;
+    size_t done = 0;
+    while (done < ad_len) {
+        size_t len = (ad_len - done < IDENTIFY_PRUNE_CHUNK) ? ad_len - done : IDENTIFY_PRUNE_CHUNK;
+        partial += job->dot(window + done, job->ad_data + done, len);
+        done += len;
+
+        // The rest adds at most the root of its energies' product, compared squared
+        double needed = lowest - (double)partial;
+        if (done < ad_len && needed > 0.0 &&
+            (double)window_energy(ws, i, done) * (double)job->ad_rest[done / IDENTIFY_PRUNE_CHUNK] *
+            (1.0 + 1e-9) < needed * needed) {
+            return false;
+        }
+    }
+
+    *dot = partial;
+    return identify_accepts(job, ws, i, partial);
+}
+
+// Sample offsets [start, end) of a target for a scan to evaluate
+typedef struct offset_range {
+    size_t start;
+    size_t end;
+} offset_range;
+
+// Evaluate the frame-aligned offsets of `n` ranges of a job, given in increasing order,
+// calling `on_match` in order for each matching offset with its score. The callback
+// returns how many offsets to skip after a match, so the sequential scan can jump past the
+// ad, into the next range if need be, while parallel scans record every offset.
+// Offsets are taken a block at a time. Prefix sums over the block's samples rule out the
+// windows that cannot match; blocks start at the first window that can, and a block left
+// with few candidates is correlated directly, offset by offset, instead of by the FFT.
+typedef size_t (*identify_match_fn)(void* ctx, size_t pos, double score);
+
+static bool identify_scan_ranges(const identify_job* job, const offset_range* ranges, size_t n,
+                          identify_match_fn on_match, void* ctx) {
+    size_t ad_len = job->ad_len;
+    size_t stride = job->channels;
+    size_t pos = 0;
+    size_t step = job->plan ? xcorr_step(job->plan) : IDENTIFY_MT_DIRECT_CHUNK;
+    target_cursor cur = { job->target, 0, 0, NULL };
+    size_t evaluated = 0;
+
+    xcorr_work* work = job->plan ? xcorr_work_create(job->plan) : NULL;
+    double* estimates = job->plan ? (double*) malloc(step * sizeof(double)) : NULL;
+    int16_t* scratch = (int16_t*) malloc((step + ad_len - 1) * sizeof(int16_t));
+    window_sums ws = { (uint64_t*) malloc((step + ad_len) * sizeof(uint64_t)), NULL, ad_len };
+    if (job->normalized) {
+        ws.sums = (int64_t*) malloc((step + ad_len) * sizeof(int64_t));
+    }
+    bool ok = scratch && ws.squares && (!job->normalized || ws.sums) && (!job->plan || (work && estimates));
+
+    for (size_t r = 0; ok && r < n; r++) {
+        size_t end = ranges[r].end;
+        if (pos < ranges[r].start) {
+            pos = ranges[r].start;
+        }
+        while (ok && pos < end) {
+            size_t block = (end - pos < step) ? end - pos : step;
+            const int16_t* window = target_window(&cur, pos, block + ad_len - 1, scratch);
+            window_sums_fill(&ws, window, block + ad_len - 1);
+
+            // Start every block at an offset that can match, so silence costs no transforms
+            size_t first = 0;
+            while (first < block && !identify_possible(job, &ws, first)) {
+                first += stride;
+            }
+            if (first > 0) {
+                pos += first;
+                continue;
+            }
+
+            size_t open = 0;
+            for (size_t i = 0; job->plan && i < block; i += stride) {
+                open += identify_possible(job, &ws, i);
+            }
+            bool fft = job->plan && open * ad_len > IDENTIFY_FFT_WORK * (step + ad_len);
+            double margin = 0.0;
+            if (fft) {
+                margin = xcorr_run(job->plan, work, window, block + ad_len - 1, estimates);
+            }
+
+            size_t i = 0;
+            while (i < block) {
+                int64_t dot = 0;
+                bool match = false;
+                if (identify_possible(job, &ws, i)) {
+                    evaluated++;
+                    if (!fft) {
+                        match = identify_direct(job, &ws, i, window + i, &dot);
+                    }
+                    else if (!identify_estimate_rejects(job, &ws, i, estimates[i], margin)) {
+                        dot = job->dot(window + i, job->ad_data, ad_len);
+                        match = identify_accepts(job, &ws, i, dot);
+                    }
+                }
+
+                if (match) {
+                    size_t skip = on_match(ctx, pos + i, identify_score(job, &ws, i, dot));
+                    if (skip == 0) {
+                        ok = false;
+                        break;
+                    }
+                    i += skip;
+                }
+                else {
+                    i += stride;
+                }
+            }
+            pos += i;
+        }
+    }
+
+    STAT_ADD(offsets, evaluated);
+    free(ws.sums);
+    free(ws.squares);
+    free(scratch);
+    free(estimates);
+    xcorr_work_destroy(work);
+    return ok;
+}
+
+// Evaluate the frame-aligned offsets in [pos, pos + count) of a job
+static bool identify_scan(const identify_job* job, size_t pos, size_t count,
+                   identify_match_fn on_match, void* ctx) {
+    offset_range range = { pos, pos + count };
+    return identify_scan_ranges(job, &range, 1, on_match, ctx);
+}
+
+// Record a match in a sink and skip the rest of the matched window
+static size_t match_sink_match(void* ctx, size_t pos, double score) {
+    match_sink* sink = (match_sink*) ctx;
+    if (!match_sink_record(sink, pos, score)) {
+        return 0;
+    }
+    return sink->ad_len;
+}
+
+// Store the write generations of the blocks of a subtree's segments, in order, from `out`
+// on; returns the slot after the last
+static uint64_t* tree_block_writes(const segment* node, uint64_t* out) {
+    while (node) {
+        out = tree_block_writes(node->left, out);
+        *out++ = atomic_load(&node->block->writes);
+        node = node->right;
+    }
+    return out;
+}
+
+// Return the track's pyramid with a reference for the caller, replacing the cached one if
+// the track was edited since it was built or any of its blocks written to, through it or
+// through another track sharing them; NULL on allocation failure. The pyramid is not part
+// of the track's value, so a const track still caches one.
+// While the track version is the same its segments are too, so their blocks are alive and
+// their generations can be compared in order.
+static track_pyramid* track_pyramid_acquire(const struct sound_seg* track) {
+    struct sound_seg* cache = (struct sound_seg*) track;
+    uint64_t epoch = atomic_load(&cache->epoch);
+    size_t segments = tree_count(cache->root);
+    uint64_t* writes = (uint64_t*) malloc((segments + 1) * sizeof(uint64_t));
+    if (!writes) {
+        return NULL;
+    }
+    tree_block_writes(cache->root, writes);
+
+    spin_lock(&cache->pyramid_lock);
+    track_pyramid* stale = cache->pyramid;
+    if (stale && stale->epoch == epoch && stale->segments == segments &&
+        memcmp(stale->writes, writes, segments * sizeof(uint64_t)) == 0) {
+        stale = NULL;
+    }
+    else {
+        cache->pyramid = (track_pyramid*) calloc(1, sizeof(track_pyramid));
+        if (cache->pyramid) {
+            atomic_init(&cache->pyramid->refcount, 1);
+            for (size_t l = 0; l < PYRAMID_MAX_LEVELS; l++) {
+                atomic_init(&cache->pyramid->levels[l], NULL);
+            }
+            cache->pyramid->epoch = epoch;
+            cache->pyramid->writes = writes;
+            cache->pyramid->segments = segments;
+            writes = NULL;
+        }
+    }
+    track_pyramid* pyramid = cache->pyramid;
+    if (pyramid) {
+        atomic_fetch_add(&pyramid->refcount, 1);
+    }
+    spin_unlock(&cache->pyramid_lock);
+
+    free(writes);
+    track_pyramid_release(stale);
+    return pyramid;
+}
+
+// Return a new track of half the rate of `src`: frame k of each channel is the [1, 2, 1] / 4
+// average of source frames 2k - 1, 2k and 2k + 1, which removes what the halved rate would
+// alias. Returns NULL on allocation failure.
+static struct sound_seg* pyramid_halve(const struct sound_seg* src) {
+    size_t channels = src->channels;
+    size_t frames = track_samples(src) / channels / 2;
+    struct sound_seg* half = tr_init_fmt(src->channels, src->sample_rate > 1 ? src->sample_rate / 2 : 1);
+    int16_t* in = (int16_t*) malloc((2 * PYRAMID_CHUNK + 1) * channels * sizeof(int16_t));
+    int16_t* out = (int16_t*) malloc(PYRAMID_CHUNK * channels * sizeof(int16_t));
+    if (!half || !in || !out) {
+        free(out);
+        free(in);
+        tr_destroy(half);
+        return NULL;
+    }
+
+    for (size_t k = 0; k < frames; k += PYRAMID_CHUNK) {
+        size_t count = (frames - k < PYRAMID_CHUNK) ? frames - k : PYRAMID_CHUNK;
+        size_t from = (k == 0) ? 0 : 2 * k - 1;
+        track_read(src, in, from * channels, (2 * (k + count) - from) * channels);
+
+        for (size_t j = 0; j < count; j++) {
+            const int16_t* center = in + (2 * (k + j) - from) * channels;
+            const int16_t* before = (k + j == 0) ? center : center - channels;
+            for (size_t c = 0; c < channels; c++) {
+                int32_t sum = before[c] + 2 * center[c] + center[channels + c];
+                out[j * channels + c] = (int16_t)(sum / 4);
+            }
+        }
+        track_write(half, out, k * channels, count * channels);
+    }
+
+    free(out);
+    free(in);
+    if (track_samples(half) != frames * channels) {
+        tr_destroy(half);
+        return NULL;
+    }
+    return half;
+}
+
+// Return level `level` >= 1 of a pyramid of `track`, first building whichever levels up to
+// it no query has built yet; NULL on allocation failure. Queries racing to build a level
+// keep the first one built.
+static const struct sound_seg* track_pyramid_level(track_pyramid* pyramid, const struct sound_seg* track,
+                                            size_t level) {
+    const struct sound_seg* below = track;
+    for (size_t l = 0; l < level; l++) {
+        struct sound_seg* current = atomic_load(&pyramid->levels[l]);
+        if (!current) {
+            struct sound_seg* built = pyramid_halve(below);
+            if (!built) {
+                return NULL;
+            }
+            current = built;
+            struct sound_seg* expected = NULL;
+            if (!atomic_compare_exchange_strong(&pyramid->levels[l], &expected, built)) {
+                tr_destroy(built);
+                current = expected;
+            }
+        }
+        below = current;
+    }
+    return below;
+}
+
+// Full-rate offsets to refine after the coarse pass of a coarse-to-fine identification
+typedef struct coarse_candidates {
+    offset_range* ranges;      // merged, in increasing order
+    size_t count;
+    size_t capacity;
+    size_t factor;             // full-rate frames per coarse frame
+    size_t channels;
+    size_t offsets;            // full-rate offsets of the target, in samples
+} coarse_candidates;
+
+// Widen a coarse match to the full-rate offsets less than a coarse frame away, which are
+// the ones it can stand for, merging them into the last range where they meet it, and keep
+// scanning from the next coarse frame
+static size_t coarse_candidate_match(void* ctx, size_t pos, double score) {
+    (void)score;
+    coarse_candidates* cands = (coarse_candidates*) ctx;
+    size_t center = pos / cands->channels * cands->factor;
+    size_t first = (center >= cands->factor) ? center - cands->factor + 1 : 0;
+    size_t start = first * cands->channels;
+    size_t end = (center + cands->factor - 1) * cands->channels + 1;
+    if (end > cands->offsets) {
+        end = cands->offsets;
+    }
+    if (start >= end) {
+        return cands->channels;
+    }
+
+    if (cands->count > 0 && cands->ranges[cands->count - 1].end >= start) {
+        offset_range* last = &cands->ranges[cands->count - 1];
+        last->end = (end > last->end) ? end : last->end;
+        return cands->channels;
+    }
+    if (cands->count == cands->capacity) {
+        size_t new_cap = cands->capacity == 0 ? 16 : cands->capacity * 2;
+        offset_range* ranges = (offset_range*) realloc(cands->ranges, new_cap * sizeof(offset_range));
+        if (!ranges) return 0;
+
+        cands->ranges = ranges;
+        cands->capacity = new_cap;
+    }
+    cands->ranges[cands->count].start = start;
+    cands->ranges[cands->count].end = end;
+    cands->count++;
+    return cands->channels;
+}
+
+// Scan a job coarse to fine: correlate level `levels` of the target's and the ad's pyramids
+// under the relaxed threshold, then apply the exact one at the full rate only around what
+// that finds. An ad with nothing left at the coarse level is scanned in full.
+// Every match reported passes the exact threshold, but one whose likeness lies mostly
+// above the coarse rate's band can fall under the relaxed one and be missed.
+static bool identify_coarse(const identify_job* job, const struct sound_seg* target, const struct sound_seg* ad,
+                     const tr_identify_opts* opts, size_t levels, match_sink* sink) {
+    track_pyramid* target_pyramid = track_pyramid_acquire(target);
+    track_pyramid* ad_pyramid = track_pyramid_acquire(ad);
+    const struct sound_seg* coarse_target = NULL;
+    const struct sound_seg* coarse_ad = NULL;
+    if (target_pyramid && ad_pyramid) {
+        coarse_target = track_pyramid_level(target_pyramid, target, levels);
+        coarse_ad = track_pyramid_level(ad_pyramid, ad, levels);
+    }
+    bool ok = coarse_target && coarse_ad;
+
+    coarse_candidates cands = { NULL, 0, 0, (size_t)1 << levels, job->channels, job->offsets };
+    offset_range all = { 0, job->offsets };
+    const offset_range* ranges = &all;
+    size_t count = 1;
+    identify_job coarse;
+    if (ok && identify_job_init(&coarse, coarse_target, coarse_ad, opts)) {
+        identify_job_relax(&coarse, (opts->coarse_relax > 0.0) ? opts->coarse_relax : 0.5);
+        ok = identify_scan(&coarse, 0, coarse.offsets, coarse_candidate_match, &cands);
+        identify_job_release(&coarse);
+        ranges = cands.ranges;
+        count = cands.count;
+    }
+
+    if (ok) {
+        ok = identify_scan_ranges(job, ranges, count, match_sink_match, sink);
+    }
+    free(cands.ranges);
+    track_pyramid_release(ad_pyramid);
+    track_pyramid_release(target_pyramid);
+    return ok;
+}
+
+// Scan the whole target into `sink`; returns false if the scan could not complete
+static bool identify_collect(const struct sound_seg* target, const struct sound_seg* ad,
+                      const tr_identify_opts* opts, match_sink* sink) {
+    identify_job job;
+    if (!identify_job_init(&job, target, ad, opts)) {
+        return true;
+    }
+
+    sink->ad_len = job.ad_len;
+    sink->reference = job.reference;
+    sink->channels = job.channels;
+
+    // As many levels as asked for that leave the ad long enough to correlate
+    size_t levels = opts ? opts->coarse_levels : 0;
+    if (levels > PYRAMID_MAX_LEVELS) {
+        levels = PYRAMID_MAX_LEVELS;
+    }
+    while (levels > 0 && (job.ad_len / job.channels >> levels) < IDENTIFY_COARSE_MIN_AD) {
+        levels--;
+    }
+
+    bool ok = (levels > 0) ? identify_coarse(&job, target, ad, opts, levels, sink)
+                           : identify_scan(&job, 0, job.offsets, match_sink_match, sink);
+
+    identify_job_release(&job);
+    return ok;
+}
+
+// Find the matches of `ad` in `target` under the given options, storing at most `cap`
+// of them in `out`
+// The normalized cross-correlation removes each window's and the ad's mean and divides by
+// their deviations, so a match survives any change of gain or DC offset; windows and ads
+// of constant samples never match. Channels are correlated together, as one signal.
+// Coarse levels are capped at as many halvings as leave the ad 32 frames long, and each
+// track caches its halved versions until it is edited or its samples are written.
+// Returns the total number of matches, so a caller whose array was too small can retry
+size_t tr_identify_ex(const struct sound_seg* target, const struct sound_seg* ad,
+                      const tr_identify_opts* opts, tr_match* out, size_t cap) {
+    match_sink sink = { out, 0, out ? cap : 0, false, 0, 0.0, 1 };
+    if (!identify_collect(target, ad, opts, &sink)) {
+        return SIZE_MAX;
+    }
+    return sink.count;
+}
+
+// Find the matches of `ad` in `target`, storing at most `cap` of them in `out`
+size_t tr_identify_matches(const struct sound_seg* target, const struct sound_seg* ad,
+                           tr_match* out, size_t cap) {
+    return tr_identify_ex(target, ad, NULL, out, cap);
+}
+
+// Return matches as "start,end" lines, or an empty string if the scan failed
+static char* identify_format(match_sink* sink, bool ok) {
+    char* results = ok ? format_matches(sink->matches, sink->count) : NULL;
+    free(sink->matches);
+    return results ? results : empty_identify_result();
+}
+
+// Search for segments in `target` that match the given `ad` segment using correlation
+// Long ads are correlated in the frequency domain with overlap-save blocks, short ads
+// and threshold checks use the widest exact int16 dot product kernel the CPU supports
+char* tr_identify(const struct sound_seg* target, const struct sound_seg* ad) {
+    match_sink sink = { NULL, 0, 0, true, 0, 0.0, 1 };
+    bool ok = identify_collect(target, ad, NULL, &sink);
+    return identify_format(&sink, ok);
+}
+
+// Work shared by the threads of a parallel identification
+typedef struct identify_pool {
+    const identify_job* job;
+    uint64_t* hits;            // one bit per candidate offset
+    size_t chunk;              // offsets per work item, a multiple of 64 and of the channels
+    atomic_size_t next;        // first offset of the next unclaimed work item
+    atomic_bool failed;
+} identify_pool;
+
+// Set the hit bit of a matching offset and keep scanning from the next frame
+static size_t identify_pool_match(void* ctx, size_t pos, double score) {
+    (void)score;
+    identify_pool* pool = (identify_pool*) ctx;
+    pool->hits[pos / 64] |= (uint64_t)1 << (pos % 64);
+    return pool->job->channels;
+}
+
+// Claim chunks of offsets until none are left; chunks own whole words of the hit bitset
+static void* identify_pool_worker(void* arg) {
+    identify_pool* pool = (identify_pool*) arg;
+    size_t offsets = pool->job->offsets;
+
+    while (!atomic_load(&pool->failed)) {
+        size_t start = atomic_fetch_add(&pool->next, pool->chunk);
+        if (start >= offsets) break;
+
+        size_t count = (offsets - start < pool->chunk) ? offsets - start : pool->chunk;
+        if (!identify_scan(pool->job, start, count, identify_pool_match, pool)) {
+            atomic_store(&pool->failed, true);
+        }
+    }
+    return NULL;
+}
+
+// Identify occurrences of ad within target using several threads
+// Every offset is evaluated in parallel, then the greedy non-overlapping pass runs
+// sequentially over the hit bitset so the result matches tr_identify exactly
+char* tr_identify_mt(const struct sound_seg* target, const struct sound_seg* ad, size_t nthreads) {
+    identify_job job;
+    if (!identify_job_init(&job, target, ad, NULL)) {
+        return empty_identify_result();
+    }
+
+    if (nthreads == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        nthreads = (cpus > 0) ? (size_t)cpus : 1;
+    }
+
+    bool ok = true;
+    // Chunks start on frames and own whole words of the bitset
+    size_t chunk = IDENTIFY_MT_DIRECT_CHUNK;
+    if (job.plan) {
+        chunk = xcorr_step(job.plan) / 64 * 64;
+    }
+    chunk *= job.channels;
+
+    identify_pool pool;
+    pool.job = &job;
+    pool.hits = (uint64_t*) calloc(job.offsets / 64 + 1, sizeof(uint64_t));
+    pool.chunk = chunk;
+    atomic_init(&pool.next, 0);
+    atomic_init(&pool.failed, !pool.hits);
+
+    size_t max_useful = (job.offsets + chunk - 1) / chunk;
+    if (nthreads > max_useful) {
+        nthreads = max_useful;
+    }
+
+    pthread_t* threads = (pthread_t*) malloc(nthreads * sizeof(pthread_t));
+    size_t started = 0;
+    if (threads && pool.hits) {
+        while (started + 1 < nthreads &&
+               pthread_create(&threads[started], NULL, identify_pool_worker, &pool) == 0) {
+            started++;
+        }
+    }
+
+    // The calling thread works too, and finishes alone if no thread could be started
+    identify_pool_worker(&pool);
+    for (size_t i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    ok = !atomic_load(&pool.failed);
+
+    match_sink sink = { NULL, 0, 0, true, job.ad_len, job.reference, job.channels };
+    target_cursor cur = { target, 0, 0, NULL };
+    size_t pos = 0;
+    while (ok && pos < job.offsets) {
+        uint64_t word = pool.hits[pos / 64] >> (pos % 64);
+        if (word == 0) {
+            pos = (pos / 64 + 1) * 64;
+            continue;
+        }
+        pos += (size_t)__builtin_ctzll(word);
+        if (pos >= job.offsets) break;
+
+        int64_t dot = target_window_dot(&cur, pos, job.ad_data, job.ad_len, job.dot);
+        ok = match_sink_add(&sink, pos, dot);
+        pos += job.ad_len;
+    }
+
+    free(pool.hits);
+    identify_job_release(&job);
+    return identify_format(&sink, ok);
+}
+
+// Free match lists returned by tr_identify_many
+void tr_match_lists_free(tr_match_list* lists, size_t n) {
+    if (!lists) return;
+
+    for (size_t k = 0; k < n; k++) {
+        free(lists[k].matches);
+    }
+    free(lists);
+}
+
+// Scan state of one ad in a multi-pattern identification
+typedef struct identify_many_ad {
+    const int16_t* data;
+    int16_t* copy;
+    size_t len;
+    size_t offsets;            // 0 when the ad cannot occur in the target
+    double reference;
+    size_t pattern;            // index in the shared FFT plan, or SIZE_MAX if direct
+    size_t next_pos;           // first offset not yet decided
+    match_sink sink;
+} identify_many_ad;
+
+// Identify every ad of `ads` in `target` in a single pass over the target
+// Each target block is gathered and transformed once; every FFT ad then needs only its
+// spectrum product and inverse transform, and short ads reuse the gathered block
+tr_match_list* tr_identify_many(const struct sound_seg* target, const struct sound_seg* const ads[], size_t n) {
+    if (n == 0 || !ads) {
+        return NULL;
+    }
+
+    tr_match_list* lists = (tr_match_list*) calloc(n, sizeof(tr_match_list));
+    identify_many_ad* state = (identify_many_ad*) calloc(n, sizeof(identify_many_ad));
+    const int16_t** fft_ads = (const int16_t**) malloc(n * sizeof(int16_t*));
+    size_t* fft_lens = (size_t*) malloc(n * sizeof(size_t));
+    bool ok = lists && state && fft_ads && fft_lens;
+
+    size_t target_len = track_samples(target);
+    size_t stride = target ? target->channels : 1;
+    dot_kernel dot = dot_kernel_select(NULL);
+    size_t fft_count = 0;
+    size_t max_len = 0;
+    size_t max_offsets = 0;
+
+    for (size_t k = 0; ok && k < n; k++) {
+        identify_many_ad* ad = &state[k];
+        ad->len = track_samples(ads[k]);
+        ad->pattern = SIZE_MAX;
+        if (!ads[k] || ads[k]->channels != stride || ad->len == 0 || ad->len > target_len) {
+            continue;
+        }
+
+        ad->data = identify_ad_samples(ads[k], ad->len, &ad->copy);
+        if (!ad->data) {
+            ok = false;
+            break;
+        }
+        ad->offsets = target_len - ad->len + 1;
+        ad->reference = (double)dot(ad->data, ad->data, ad->len) / ad->len;
+        ad->sink.growable = true;
+        ad->sink.ad_len = ad->len;
+        ad->sink.reference = ad->reference;
+        ad->sink.channels = stride;
+
+        if (ad->len >= IDENTIFY_FFT_MIN_AD) {
+            ad->pattern = fft_count;
+            fft_ads[fft_count] = ad->data;
+            fft_lens[fft_count] = ad->len;
+            fft_count++;
+        }
+        if (ad->len > max_len) max_len = ad->len;
+        if (ad->offsets > max_offsets) max_offsets = ad->offsets;
+    }
+
+    xcorr_plan* plan = NULL;
+    xcorr_work* work = NULL;
+    size_t step = IDENTIFY_MT_DIRECT_CHUNK;
+    if (ok && fft_count > 0) {
+        plan = xcorr_plan_create_many(fft_ads, fft_lens, fft_count);
+        work = plan ? xcorr_work_create(plan) : NULL;
+        ok = (work != NULL);
+        if (ok) {
+            step = xcorr_step(plan);
+        }
+    }
+
+    double* estimates = NULL;
+    int16_t* scratch = NULL;
+    if (ok && max_offsets > 0) {
+        estimates = (double*) malloc(step * sizeof(double));
+        scratch = (int16_t*) malloc((step + max_len - 1) * sizeof(int16_t));
+        ok = estimates && scratch;
+    }
+
+    target_cursor cur = { target, 0, 0, NULL };
+    for (size_t block_pos = 0; ok && block_pos < max_offsets; block_pos += step) {
+        size_t window_len = step + max_len - 1;
+        if (window_len > target_len - block_pos) {
+            window_len = target_len - block_pos;
+        }
+        const int16_t* window = target_window(&cur, block_pos, window_len, scratch);
+        if (plan) {
+            xcorr_load(plan, work, window, window_len);
+        }
+
+        for (size_t k = 0; ok && k < n; k++) {
+            identify_many_ad* ad = &state[k];
+            if (ad->next_pos >= ad->offsets || ad->next_pos >= block_pos + step) {
+                continue;
+            }
+
+            size_t count = ad->offsets - block_pos;
+            if (count > step) {
+                count = step;
+            }
+
+            double margin = 0.0;
+            if (ad->pattern != SIZE_MAX) {
+                margin = xcorr_apply(plan, work, ad->pattern, estimates);
+            }
+
+            size_t i = ad->next_pos - block_pos;
+            size_t evaluated = 0;
+            while (i < count) {
+                bool match;
+                evaluated++;
+                if (ad->pattern != SIZE_MAX) {
+                    match = estimate_matches(estimates[i], margin, window + i,
+                                             ad->data, ad->len, ad->reference, dot);
+                }
+                else {
+                    match = correlation_matches(dot(window + i, ad->data, ad->len),
+                                                ad->len, ad->reference);
+                }
+
+                if (match) {
+                    if (!match_sink_add(&ad->sink, block_pos + i, dot(window + i, ad->data, ad->len))) {
+                        ok = false;
+                        break;
+                    }
+                    i += ad->len;
+                }
+                else {
+                    i += stride;
+                }
+            }
+            ad->next_pos = block_pos + i;
+            STAT_ADD(offsets, evaluated);
+        }
+    }
+
+    free(scratch);
+    free(estimates);
+    xcorr_work_destroy(work);
+    xcorr_plan_destroy(plan);
+    if (state) {
+        for (size_t k = 0; k < n; k++) {
+            free(state[k].copy);
+            if (lists) {
+                lists[k].matches = state[k].sink.matches;
+                lists[k].count = state[k].sink.count;
+            }
+        }
+    }
+    free(state);
+    free(fft_ads);
+    free(fft_lens);
+
+    if (!ok) {
+        tr_match_lists_free(lists, lists ? n : 0);
+        return NULL;
+    }
+    return lists;
+}
+
+// Incremental matcher state; the window buffer holds the stream samples from the
+// earliest offset still to be evaluated up to the newest pushed sample
+struct tr_identify_stream {
+    int16_t* ad_data;
+    size_t ad_len;
+    size_t channels;           // samples per pushed frame
+    double reference;
+    dot_kernel dot;
+    xcorr_plan* plan;          // NULL when the ad is correlated directly
+    xcorr_work* work;
+    double* estimates;
+    size_t step;               // offsets evaluated per block
+    int16_t* window;
+    size_t window_start;       // stream position of window[0]
+    size_t window_len;
+    size_t window_cap;
+    tr_match_callback callback;
+    void* user;
+    tr_match* queued;          // matches waiting to be polled
+    size_t queue_head;
+    size_t queue_len;
+    size_t queue_cap;
+};
+
+// Create a streaming matcher with its own copy of the ad
+tr_identify_stream* tr_identify_stream_init(const struct sound_seg* ad) {
+    size_t ad_len = track_samples(ad);
+    if (!ad || ad_len == 0) {
+        return NULL;
+    }
+
+    tr_identify_stream* stream = (tr_identify_stream*) calloc(1, sizeof(tr_identify_stream));
+    if (!stream) return NULL;
+
+    stream->ad_len = ad_len;
+    stream->channels = ad->channels;
+    stream->ad_data = (int16_t*) malloc(ad_len * sizeof(int16_t));
+    if (!stream->ad_data) {
+        tr_identify_stream_destroy(stream);
+        return NULL;
+    }
+    track_read(ad, stream->ad_data, 0, ad_len);
+
+    stream->dot = dot_kernel_select(NULL);
+    stream->reference = (double)stream->dot(stream->ad_data, stream->ad_data, ad_len) / ad_len;
+    stream->step = IDENTIFY_MT_DIRECT_CHUNK;
+
+    if (ad_len >= IDENTIFY_FFT_MIN_AD) {
+        stream->plan = xcorr_plan_create(stream->ad_data, ad_len);
+        stream->work = stream->plan ? xcorr_work_create(stream->plan) : NULL;
+        if (!stream->work) {
+            tr_identify_stream_destroy(stream);
+            return NULL;
+        }
+        stream->step = xcorr_step(stream->plan);
+    }
+
+    stream->window_cap = stream->step + ad_len - 1;
+    stream->window = (int16_t*) malloc(stream->window_cap * sizeof(int16_t));
+    stream->estimates = (double*) malloc(stream->step * sizeof(double));
+    if (!stream->window || !stream->estimates) {
+        tr_identify_stream_destroy(stream);
+        return NULL;
+    }
+    return stream;
+}
+
+// Deliver matches to a callback instead of queueing them
+void tr_identify_stream_on_match(tr_identify_stream* stream, tr_match_callback callback, void* user) {
+    if (!stream) return;
+
+    stream->callback = callback;
+    stream->user = user;
+}
+
+// Report a match at sample `start` of the stream through the callback or the poll queue
+static bool identify_stream_report(tr_identify_stream* stream, size_t start, int64_t dot) {
+    tr_match match;
+    match.start = start / stream->channels;
+    match.end = (start + stream->ad_len) / stream->channels - 1;
+    match.score = match_score(dot, stream->ad_len, stream->reference);
+
+    if (stream->callback) {
+        stream->callback(stream->user, &match);
+        return true;
+    }
+
+    if (stream->queue_head + stream->queue_len == stream->queue_cap) {
+        if (stream->queue_head > 0) {
+            memmove(stream->queued, stream->queued + stream->queue_head,
+                    stream->queue_len * sizeof(tr_match));
+            stream->queue_head = 0;
+        }
+        else {
+            size_t new_cap = stream->queue_cap == 0 ? 16 : stream->queue_cap * 2;
+            tr_match* new_queue = (tr_match*) realloc(stream->queued, new_cap * sizeof(tr_match));
+            if (!new_queue) return false;
+
+            stream->queued = new_queue;
+            stream->queue_cap = new_cap;
+        }
+    }
+    stream->queued[stream->queue_head + stream->queue_len] = match;
+    stream->queue_len++;
+    return true;
+}
+
+// Evaluate buffered offsets whose windows are complete. Without `force` the FFT path
+// waits until a whole block is available so every transform yields `step` offsets.
+static bool identify_stream_evaluate(tr_identify_stream* stream, bool force) {
+    size_t ad_len = stream->ad_len;
+
+    while (stream->window_len >= ad_len) {
+        size_t available = stream->window_len - ad_len + 1;
+        if (stream->plan && available < stream->step && !force) {
+            break;
+        }
+
+        size_t count = (available < stream->step) ? available : stream->step;
+        double margin = 0.0;
+        if (stream->plan) {
+            margin = xcorr_run(stream->plan, stream->work, stream->window,
+                               count + ad_len - 1, stream->estimates);
+        }
+
+        size_t i = 0;
+        size_t evaluated = 0;
+        while (i < count) {
+            bool match;
+            evaluated++;
+            if (stream->plan) {
+                match = estimate_matches(stream->estimates[i], margin, stream->window + i,
+                                         stream->ad_data, ad_len, stream->reference, stream->dot);
+            }
+            else {
+                int64_t dot = stream->dot(stream->window + i, stream->ad_data, ad_len);
+                match = correlation_matches(dot, ad_len, stream->reference);
+            }
+
+            if (match) {
+                int64_t dot = stream->dot(stream->window + i, stream->ad_data, ad_len);
+                if (!identify_stream_report(stream, stream->window_start + i, dot)) {
+                    return false;
+                }
+                i += ad_len;
+            }
+            else {
+                i += stream->channels;
+            }
+        }
+
+        STAT_ADD(offsets, evaluated);
+
+        // Offsets before i are decided; at most ad_len - 1 samples are carried over
+        memmove(stream->window, stream->window + i, (stream->window_len - i) * sizeof(int16_t));
+        stream->window_start += i;
+        stream->window_len -= i;
+    }
+    return true;
+}
+
+// Append frames to the stream, evaluating each block as soon as it fills
+bool tr_identify_stream_push(tr_identify_stream* stream, const int16_t* samples, size_t n) {
+    if (!stream || (!samples && n > 0) || n > SIZE_MAX / stream->channels) {
+        return false;
+    }
+
+    n *= stream->channels;
+    while (n > 0) {
+        size_t room = stream->window_cap - stream->window_len;
+        size_t take = (n < room) ? n : room;
+
+        memcpy(stream->window + stream->window_len, samples, take * sizeof(int16_t));
+        stream->window_len += take;
+        samples += take;
+        n -= take;
+
+        if (!identify_stream_evaluate(stream, false)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Evaluate every offset whose window is complete, even if the block is partial
+bool tr_identify_stream_flush(tr_identify_stream* stream) {
+    if (!stream) return false;
+
+    return identify_stream_evaluate(stream, true);
+}
+
+// Pop the oldest queued match
+bool tr_identify_stream_poll(tr_identify_stream* stream, tr_match* match) {
+    if (!stream || stream->queue_len == 0) {
+        return false;
+    }
+
+    if (match) {
+        *match = stream->queued[stream->queue_head];
+    }
+    stream->queue_head++;
+    stream->queue_len--;
+    if (stream->queue_len == 0) {
+        stream->queue_head = 0;
+    }
+
+    return true;
+}
+
+// Destroy a streaming matcher
+void tr_identify_stream_destroy(tr_identify_stream* stream) {
+    if (!stream) return;
+
+    free(stream->ad_data);
+    xcorr_work_destroy(stream->work);
+    xcorr_plan_destroy(stream->plan);
+    free(stream->estimates);
+    free(stream->window);
+    free(stream->queued);
+    free(stream);
+}
+
+// Extract a shared segment chain from src_track starting at srcpos with length len
+// Each copy shares the source piece's samples in a new child span and covers them in the
+// source span; the source track itself is left unchanged. The copies are returned as a
+// detached tree allocated from the pools of `dest_track`, where they will be inserted.
+static segment* extract_segment_slice(struct sound_seg* src_track, size_t srcpos, size_t len,
+                               struct sound_seg* dest_track) {
+    size_t track_len = track_samples(src_track);
+    if (!src_track || len == 0 || srcpos > track_len || len > track_len - srcpos) {
+        return NULL;
+    }
+
+    size_t seg_start = 0;
+    segment* seg = tree_find(src_track->root, srcpos, &seg_start);
+    size_t local_offset = srcpos - seg_start;
+    segment* result = NULL;
+
+    while (seg && len > 0) {
+        size_t available = seg->length - local_offset;
+        size_t chunk = (len < available) ? len : available;
+        size_t offset = seg->offset + local_offset;
+
+        segment* new_seg = (segment*) slab_alloc(dest_track->segments);
+        span* sp = new_seg ? span_create(dest_track->spans, seg->span) : NULL;
+        bool covered = false;
+        if (sp) {
+            spin_lock(&seg->span->lock);
+            covered = coverage_add(&seg->span->coverage, offset, offset + chunk);
+            spin_unlock(&seg->span->lock);
+        }
+        if (!covered) {
+            span_release(sp);
+            slab_free(new_seg);
+            tree_withdraw(result);
+            tree_release(result);
+            return NULL;
+        }
+
+        STAT_ADD(allocations, 1);
+        new_seg->block = seg->block;
+        new_seg->span = sp;
+        new_seg->offset = offset;
+        new_seg->length = chunk;
+        tree_init_node(new_seg);
+        atomic_fetch_add(&seg->block->refcount, 1);
+
+        result = tree_merge(result, new_seg, &dest_track->failed);
+
+        len -= chunk;
+        local_offset = 0;
+        seg = tree_step(src_track->root, seg, &seg_start);
+    }
+    return result;
+}
+
+// Insert the given segment chain into the track at destpos
+static bool insert_segment_chain(struct sound_seg* track, size_t destpos, segment* insert_chain) {
+    size_t track_len = track_samples(track);
+    if (!track || !insert_chain || destpos > track_len) {
+        return false;
+    }
+
+    split_track_at(track, destpos);
+    track->length += tree_length(insert_chain);
+
+    segment *before, *after;
+    tree_split(track->root, destpos, &before, &after, &track->failed);
+    track->root = tree_merge(tree_merge(before, insert_chain, &track->failed), after, &track->failed);
+    return true;
+}
+
+// Insert a portion from src_track into dest_track; both must have the same channels
+void tr_insert(struct sound_seg* src_track,
+               struct sound_seg* dest_track,
+               size_t destpos, size_t srcpos, size_t len) {
+    if (!src_track || !dest_track || dest_track->snapshot || len == 0 ||
+        src_track->channels != dest_track->channels) {
+        return;
+    }
+
+    size_t src_len = track_samples(src_track);
+    size_t dest_len = track_samples(dest_track);
+    destpos = track_frames_to_samples(dest_track, destpos);
+    srcpos = track_frames_to_samples(src_track, srcpos);
+    len = track_frames_to_samples(src_track, len);
+    if (srcpos > src_len || len > src_len - srcpos || destpos > dest_len) {
+        return;
+    }
+
+    // Cut the destination first so the extracted chain is never split while detached
+    if (!track_reserve(dest_track)) {
+        return;
+    }
+    split_track_at(dest_track, destpos);
+
+    segment* ref_chain = extract_segment_slice(src_track, srcpos, len, dest_track);
+    if (!ref_chain) {
+        track_publish(dest_track);
+        return;
+    }
+
+    // The new nodes may have used up the reservation
+    if (!track_reserve(dest_track)) {
+        tree_withdraw(ref_chain);
+        tree_release(ref_chain);
+        track_publish(dest_track);
+        return;
+    }
+
+    // Kept whole by an extra reference, so a failed edit can withdraw the chain's cover
+    atomic_fetch_add(&ref_chain->refcount, 1);
     insert_segment_chain(dest_track, destpos, ref_chain);
-} 
\ No newline at end of file
+    if (!track_publish(dest_track)) {
+        tree_withdraw(ref_chain);
+    }
+    tree_release(ref_chain);
+}
+
+// One queued edit of a batch
+typedef struct batch_edit {
+    size_t pos;                // position in the track before the batch
+    size_t len;                // samples to delete, or to copy for an insert
+    struct sound_seg* src;     // source track of an insert, NULL for a delete
+    size_t srcpos;
+    size_t seq;                // queue order, which breaks ties between inserts
+    segment* chain;            // the copies an insert splices in
+    segment* removed;          // the segments a delete took out
+} batch_edit;
+
+// Edits queued against one track until tr_batch_commit
+// Inserts copy their sources as they are before the batch, even an insert from the track
+// itself whose source other edits of the batch move. Inserts at one position keep their
+// queue order and land before a delete starting there.
+struct tr_batch {
+    struct sound_seg* track;
+    batch_edit* edits;
+    size_t count;
+    size_t capacity;
+    bool failed;               // an edit could not be queued, so the batch cannot commit
+};
+
+// Start an empty batch of edits to a track
+tr_batch* tr_batch_begin(struct sound_seg* track) {
+    if (!track || track->snapshot) {
+        return NULL;
+    }
+
+    tr_batch* batch = (tr_batch*) calloc(1, sizeof(tr_batch));
+    if (!batch) return NULL;
+
+    batch->track = track;
+    return batch;
+}
+
+// Append an edit to the batch's queue, growing it geometrically
+static bool batch_queue(tr_batch* batch, struct sound_seg* src, size_t pos, size_t srcpos, size_t len) {
+    if (batch->count == batch->capacity) {
+        size_t new_cap = batch->capacity == 0 ? 16 : batch->capacity * 2;
+        batch_edit* edits = (batch_edit*) realloc(batch->edits, new_cap * sizeof(batch_edit));
+        if (!edits) {
+            batch->failed = true;
+            return false;
+        }
+        batch->edits = edits;
+        batch->capacity = new_cap;
+    }
+
+    batch_edit* edit = &batch->edits[batch->count];
+    edit->pos = pos;
+    edit->len = len;
+    edit->src = src;
+    edit->srcpos = srcpos;
+    edit->seq = batch->count;
+    edit->chain = NULL;
+    edit->removed = NULL;
+    batch->count++;
+    return true;
+}
+
+// Queue an insert, converted to samples; like tr_insert, an empty one does nothing, while one
+// between tracks of different channel counts makes the commit fail
+bool tr_batch_insert(tr_batch* batch, struct sound_seg* src_track, size_t destpos, size_t srcpos, size_t len) {
+    if (!batch || !src_track) {
+        return false;
+    }
+    if (src_track->channels != batch->track->channels) {
+        batch->failed = true;
+        return true;
+    }
+    if (len == 0) {
+        return true;
+    }
+    struct sound_seg* track = batch->track;
+    return batch_queue(batch, src_track, track_frames_to_samples(track, destpos),
+                       track_frames_to_samples(track, srcpos), track_frames_to_samples(track, len));
+}
+
+// Queue a delete, converted to samples; it is checked against the track when the batch commits
+bool tr_batch_delete(tr_batch* batch, size_t pos, size_t len) {
+    if (!batch) {
+        return false;
+    }
+    struct sound_seg* track = batch->track;
+    return batch_queue(batch, NULL, track_frames_to_samples(track, pos), 0,
+                       track_frames_to_samples(track, len));
+}
+
+// Order edits by position; at one position inserts go first, in queue order
+static int batch_edit_compare(const void* a, const void* b) {
+    const batch_edit* x = (const batch_edit*) a;
+    const batch_edit* y = (const batch_edit*) b;
+    if (x->pos != y->pos) {
+        return x->pos < y->pos ? -1 : 1;
+    }
+    if ((x->src == NULL) != (y->src == NULL)) {
+        return x->src ? -1 : 1;
+    }
+    return x->seq < y->seq ? -1 : (x->seq > y->seq ? 1 : 0);
+}
+
+// Check that every sorted edit would succeed on the track before the batch, and that no
+// edit lands inside a deleted range; then clamp deletes to the end of the track
+static bool batch_validate(tr_batch* batch) {
+    size_t track_len = track_samples(batch->track);
+    size_t deleted_end = 0;
+
+    for (size_t i = 0; i < batch->count; i++) {
+        batch_edit* edit = &batch->edits[i];
+        if (edit->pos < deleted_end) {
+            return false;
+        }
+
+        if (edit->src) {
+            size_t src_len = track_samples(edit->src);
+            if (edit->pos > track_len || edit->srcpos > src_len || edit->len > src_len - edit->srcpos) {
+                return false;
+            }
+        }
+        else {
+            if (edit->pos >= track_len || edit->len == 0) {
+                return false;
+            }
+            // A delete running past the end would also take what is inserted there
+            deleted_end = edit->len > SIZE_MAX - edit->pos ? SIZE_MAX : edit->pos + edit->len;
+            if (edit->len > track_len - edit->pos) {
+                edit->len = track_len - edit->pos;
+            }
+        }
+    }
+    return true;
+}
+
+// Drop the copies extracted for the batch's inserts, withdrawing their cover
+static void batch_release_chains(tr_batch* batch) {
+    for (size_t i = 0; i < batch->count; i++) {
+        tree_withdraw(batch->edits[i].chain);
+        tree_release(batch->edits[i].chain);
+        batch->edits[i].chain = NULL;
+    }
+}
+
+// Copy the source of every insert and check that no delete removes covered samples
+// Sources are read before the track changes, so a delete may not remove samples that
+// an insert of the same batch copies: they are covered by then.
+static bool batch_prepare(tr_batch* batch) {
+    struct sound_seg* track = batch->track;
+
+    for (size_t i = 0; i < batch->count; i++) {
+        batch_edit* edit = &batch->edits[i];
+        if (edit->src) {
+            edit->chain = extract_segment_slice(edit->src, edit->srcpos, edit->len, track);
+            if (!edit->chain) {
+                batch_release_chains(batch);
+                return false;
+            }
+        }
+    }
+
+    for (size_t i = 0; i < batch->count; i++) {
+        batch_edit* edit = &batch->edits[i];
+        if (!edit->src && !can_delete_range(track, edit->pos, edit->len)) {
+            batch_release_chains(batch);
+            return false;
+        }
+    }
+    return true;
+}
+
+// Reserve pool room for the node copies and new nodes of one step of a batch
+static bool batch_reserve(struct sound_seg* track, segment* done, segment* rest, segment* chain) {
+    size_t height = (size_t)tree_height(done) + tree_height(rest) + tree_height(chain);
+    return slab_reserve(track->segments, TREE_EDIT_PASSES * (height + 4));
+}
+
+// Cut the first `len` samples off `*rest`
+// On failure `*taken` may hold some of them, for the caller to drop with the rest
+static bool batch_take(struct sound_seg* track, segment** rest, size_t len, segment** taken) {
+    if (!tree_cut(rest, len, track->segments, &track->failed)) {
+        return false;
+    }
+    tree_split(*rest, len, taken, rest, &track->failed);
+    return !track->failed;
+}
+
+// Apply the sorted, prepared edits in one pass from the start of the track
+// The original tree and the chains keep an extra reference until the end, so every node
+// they share is copied before it changes and a failed step can put the track back.
+// Spliced chains lend their extra reference to `done`, which gives it back if released.
+static bool batch_apply(tr_batch* batch) {
+    struct sound_seg* track = batch->track;
+    segment* original = track->root;
+    if (original) {
+        atomic_fetch_add(&original->refcount, 1);
+    }
+
+    segment* done = NULL;
+    segment* rest = original;
+    size_t consumed = 0;
+    bool ok = true;
+
+    for (size_t i = 0; i < batch->count && ok; i++) {
+        batch_edit* edit = &batch->edits[i];
+        segment* piece = NULL;
+
+        ok = batch_reserve(track, done, rest, edit->chain) &&
+             batch_take(track, &rest, edit->pos - consumed, &piece);
+        done = tree_merge(done, piece, &track->failed);
+        if (!ok) break;
+        consumed = edit->pos;
+
+        if (edit->src) {
+            atomic_fetch_add(&edit->chain->refcount, 1);
+            done = tree_merge(done, edit->chain, &track->failed);
+        }
+        else {
+            ok = batch_take(track, &rest, edit->len, &edit->removed);
+            consumed += edit->len;
+        }
+        ok = ok && !track->failed;
+    }
+
+    if (ok) {
+        done = tree_merge(done, rest, &track->failed);
+        rest = NULL;
+        ok = !track->failed;
+    }
+    if (!ok) {
+        tree_release(done);
+        tree_release(rest);
+        for (size_t i = 0; i < batch->count; i++) {
+            tree_release(batch->edits[i].removed);
+            batch->edits[i].removed = NULL;
+        }
+        track->failed = false;
+        return false;
+    }
+
+    track->root = done;
+    track->length = tree_length(track->root);
+    tree_release(original);
+    for (size_t i = 0; i < batch->count; i++) {
+        tree_release(batch->edits[i].chain);
+        batch->edits[i].chain = NULL;
+        tree_withdraw(batch->edits[i].removed);
+        tree_release(batch->edits[i].removed);
+        batch->edits[i].removed = NULL;
+    }
+    return true;
+}
+
+// Free a batch without applying it
+void tr_batch_abort(tr_batch* batch) {
+    if (!batch) {
+        return;
+    }
+
+    free(batch->edits);
+    free(batch);
+}
+
+// Validate every edit, copy the inserted samples, then splice the whole batch in one
+// pass over the track: O(k log k) to sort the edits plus O(log n) per edit
+// The batch fails as a whole if an edit would fail on its own, deletes overlap, an insert
+// falls inside a deleted range, or a delete removes samples an insert of the batch copies.
+bool tr_batch_commit(tr_batch* batch) {
+    if (!batch) {
+        return false;
+    }
+
+    bool ok = !batch->failed;
+    if (ok && batch->count > 0) {
+        qsort(batch->edits, batch->count, sizeof(batch_edit), batch_edit_compare);
+        ok = batch_validate(batch) && batch_prepare(batch);
+        if (ok && !batch_apply(batch)) {
+            batch_release_chains(batch);
+            ok = false;
+        }
+        if (ok) {
+            track_publish(batch->track);
+        }
+    }
+
+    tr_batch_abort(batch);
+    return ok;
+}
+
+// Return the monotonic clock in nanoseconds
+static uint64_t clock_nanoseconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+// Check if `next` continues `seg` in the same samples of the same span, so that one
+// segment can hold both
+static bool segments_continue(const segment* seg, const segment* next) {
+    return next && seg->block == next->block && seg->span == next->span &&
+           seg->offset + seg->length == next->offset;
+}
+
+// Check if a segment may move to a new block without changing what any other track
+// sees: it is shorter than `below`, no copy of it exists and it is no copy itself
+static bool compact_can_copy(segment* seg, size_t below) {
+    return seg->length < below && !seg->span->parent && atomic_load(&seg->span->children) == 0;
+}
+
+// Announce a copy, then check that the track has no snapshot that would keep seeing the
+// old samples. tr_snapshot counts itself before it looks for a copy, so a snapshot taken
+// meanwhile either stops the copy here or waits for it and sees the result.
+static bool compact_copy_begin(struct sound_seg* track) {
+    atomic_store(&track->copying, true);
+    if (atomic_load(&track->snapshots->live) == 0) {
+        return true;
+    }
+    atomic_store(&track->copying, false);
+    return false;
+}
+
+// Collect up to `limit` copy candidates in a row from the segment at sample `pos`
+static size_t compact_gather(const struct sound_seg* track, size_t pos, size_t below,
+                      segment** run, size_t limit) {
+    size_t count = 0;
+    size_t seg_start = 0;
+    segment* seg = tree_find(track->root, pos, &seg_start);
+
+    while (seg && count < limit && compact_can_copy(seg, below)) {
+        run[count++] = seg;
+        seg = tree_step(track->root, seg, &seg_start);
+    }
+
+    // A lone segment is only worth copying when that frees the rest of its block
+    if (count == 1 && (atomic_load(&run[0]->block->refcount) > 1 ||
+                       run[0]->length == run[0]->block->length)) {
+        count = 0;
+    }
+    return count;
+}
+
+// Swap the segments holding the samples of `node` from sample `pos` on for `node`, as an
+// edit of its own, taking over the caller's reference to `node`. The old segments are
+// dropped without withdrawing their cover, which `node` takes over through the same span,
+// or which a copied run never had.
+static bool compact_replace(struct sound_seg* track, size_t pos, segment* node) {
+    if (!track_reserve(track)) {
+        tree_release(node);
+        return false;
+    }
+
+    segment *before, *middle, *after;
+    size_t len = node->length;
+    tree_split(track->root, pos, &before, &middle, &track->failed);
+    tree_split(middle, len, &middle, &after, &track->failed);
+    track->root = tree_merge(before, tree_merge(node, after, &track->failed), &track->failed);
+    tree_release(middle);
+    return track_publish(track);
+}
+
+// Merge the segment at sample `pos` with up to `limit` - 1 following ones that continue it
+// Returns the number of segments merged, 1 if there was nothing to merge, or 0 on failure
+static size_t compact_merge(struct sound_seg* track, segment* seg, size_t pos, size_t limit) {
+    size_t count = 1;
+    size_t len = seg->length;
+    size_t next_start = pos;
+    segment* last = seg;
+    segment* next = tree_step(track->root, seg, &next_start);
+    while (count < limit && segments_continue(last, next)) {
+        len += next->length;
+        count++;
+        last = next;
+        next = tree_step(track->root, next, &next_start);
+    }
+    if (count == 1) {
+        return 1;
+    }
+
+    segment* node = (segment*) slab_alloc(track->segments);
+    if (!node) return 0;
+    STAT_ADD(allocations, 1);
+
+    node->offset = seg->offset;
+    node->length = len;
+    node->block = seg->block;
+    node->span = seg->span;
+    tree_init_node(node);
+    atomic_fetch_add(&seg->block->refcount, 1);
+    atomic_fetch_add(&seg->span->refcount, 1);
+
+    return compact_replace(track, pos, node) ? count : 0;
+}
+
+// Copy a run of segments starting at sample `pos` into one new block of its own span
+static bool compact_copy(struct sound_seg* track, segment** run, size_t count, size_t pos) {
+    size_t len = 0;
+    for (size_t i = 0; i < count; i++) {
+        len += run[i]->length;
+    }
+
+    audio_block* block = block_create(len);
+    segment* node = block ? (segment*) slab_alloc(track->segments) : NULL;
+    span* sp = node ? span_create(track->spans, NULL) : NULL;
+    if (!sp) {
+        slab_free(node);
+        if (block) block_release(block);
+        return false;
+    }
+    STAT_ADD(allocations, 1);
+
+    for (size_t i = 0; i < count; i++) {
+        memcpy(block->data + block->length, run[i]->block->data + run[i]->offset,
+               run[i]->length * sizeof(int16_t));
+        block->length += run[i]->length;
+    }
+
+    node->offset = 0;
+    node->length = len;
+    node->block = block;
+    node->span = sp;
+    tree_init_node(node);
+
+    return compact_replace(track, pos, node);
+}
+
+// Walk the segments from the one before the cursor, so groups cut by the previous call
+// join up, merging each group of continuing segments and then copying runs of short
+// ones. Positions never move, so the cursor stays valid across calls and other edits.
+// Copies skip samples inserted from another track or into one, and all samples while the
+// track has snapshots, so that writes shared through tr_insert keep reaching every track.
+// Each merge or copy is an edit of its own, so the track can be edited between calls,
+// and a pass is complete once the cursor reaches tr_length.
+size_t tr_compact(struct sound_seg* track, tr_compact_policy* policy) {
+    if (!track || !policy || track->snapshot) {
+        return 0;
+    }
+
+    uint64_t deadline = policy->max_nanoseconds ? clock_nanoseconds() + policy->max_nanoseconds : 0;
+    size_t limit = policy->max_segments ? policy->max_segments : SIZE_MAX;
+    size_t below = track_frames_to_samples(track, policy->copy_below);
+    size_t visited = 0;
+    size_t next_clock = 0;
+    size_t removed = 0;
+    bool ok = true;
+    segment* run[COMPACT_MAX_RUN];
+
+    size_t pos = track_frames_to_samples(track, policy->cursor);
+    segment* seg = tree_find(track->root, pos > 0 ? pos - 1 : 0, &pos);
+    while (seg && visited < limit) {
+        if (deadline && visited >= next_clock) {
+            if (clock_nanoseconds() >= deadline) break;
+            next_clock = visited + COMPACT_CLOCK_EVERY;
+        }
+
+        size_t room = limit - visited;
+        size_t count = compact_merge(track, seg, pos, room);
+        if (count == 0) {
+            ok = false;
+            break;
+        }
+
+        // A merged segment may still start a run to copy, so look at it again
+        if (count == 1 && below > 0) {
+            count = 0;
+            if (compact_copy_begin(track)) {
+                count = compact_gather(track, pos, below, run, room < COMPACT_MAX_RUN ? room : COMPACT_MAX_RUN);
+                ok = count == 0 || compact_copy(track, run, count, pos);
+                atomic_store(&track->copying, false);
+            }
+            if (!ok) break;
+            count = (count > 0) ? count : 1;
+            seg = tree_find(track->root, pos, &pos);
+            seg = tree_step(track->root, seg, &pos);
+        }
+        else if (count == 1) {
+            seg = tree_step(track->root, seg, &pos);
+        }
+        else {
+            seg = tree_find(track->root, pos, &pos);
+        }
+
+        visited += count;
+        removed += count - 1;
+    }
+
+    policy->cursor = (seg ? pos : track_samples(track)) / track->channels;
+    return ok ? removed : SIZE_MAX;
+}
+
+// Map a WAV file and wrap its samples in a block without copying them
+// The mapping is private and writable: tr_write stores into it like any block, and the
+// kernel copies each written page, so the file never changes. Chunks are word-aligned
+// in RIFF, so the samples are 16-bit aligned in any well-formed file.
+struct sound_seg* tr_load_wav(const char* path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    struct stat st;
+    void* mapping = MAP_FAILED;
+    size_t mapping_size = 0;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        mapping_size = (size_t)st.st_size;
+        mapping = mmap(NULL, mapping_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        return NULL;
+    }
+
+    wav_format format;
+    size_t data_offset, data_size;
+    if (!wav_parse(mapping, mapping_size, &format, &data_offset, &data_size) ||
+        format.audio_format != WAV_FORMAT_PCM || format.bits_per_sample != 16 ||
+        format.channels == 0 || data_offset % sizeof(int16_t) != 0) {
+        munmap(mapping, mapping_size);
+        return NULL;
+    }
+
+    struct sound_seg* track = tr_init_fmt(format.channels, format.sample_rate);
+    size_t frame_size = (size_t)format.channels * sizeof(int16_t);
+    size_t len = data_size / frame_size * format.channels;
+    audio_block* block = (track && len > 0) ? (audio_block*) malloc(sizeof(audio_block)) : NULL;
+    if (!block) {
+        munmap(mapping, mapping_size);
+        if (track && len > 0) {
+            tr_destroy(track);
+            return NULL;
+        }
+        return track;
+    }
+
+    block->data = (int16_t*)((char*)mapping + data_offset);
+    block->length = len;
+    block->capacity = len;
+    atomic_init(&block->refcount, 1);
+    atomic_init(&block->writes, 0);
+    block->mapping = mapping;
+    block->mapping_size = mapping_size;
+
+    if (!track_reserve(track) || !append_block(track, block)) {
+        block_release(block);
+        tr_destroy(track);
+        return NULL;
+    }
+    if (!track_publish(track)) {
+        tr_destroy(track);
+        return NULL;
+    }
+    return track;
+}
+
+// Write everything `iov` describes, resuming after partial writes
+static bool write_all(int fd, struct iovec* iov, int count) {
+    while (count > 0) {
+        ssize_t written = writev(fd, iov, count);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+
+        size_t done = (size_t)written;
+        while (count > 0 && done >= iov->iov_len) {
+            done -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char*)iov->iov_base + done;
+            iov->iov_len -= done;
+        }
+    }
+    return true;
+}
+
+// Write the header, then the track's runs of samples straight from their blocks,
+// gathering SAVE_WAV_BATCH runs per system call
+bool tr_save_wav(const struct sound_seg* track, const char* path) {
+    size_t len = track_samples(track);
+    if (!track || len > (UINT32_MAX - (WAV_HEADER_SIZE - 8)) / sizeof(int16_t)) {
+        return false;
+    }
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return false;
+    }
+
+    wav_format format = { WAV_FORMAT_PCM, track->channels, track->sample_rate, 16 };
+    unsigned char header[WAV_HEADER_SIZE];
+    wav_header(header, &format, (uint32_t)(len * sizeof(int16_t)));
+
+    struct iovec iov[SAVE_WAV_BATCH];
+    iov[0].iov_base = header;
+    iov[0].iov_len = WAV_HEADER_SIZE;
+    int count = 1;
+    bool ok = true;
+
+    tr_span_iter it;
+    track_span_begin(&it, track, 0, len);
+    size_t run_len;
+    const int16_t* run;
+    while (ok && (run = track_span_next(&it, &run_len)) != NULL) {
+        iov[count].iov_base = (void*) run;
+        iov[count].iov_len = run_len * sizeof(int16_t);
+        if (++count == SAVE_WAV_BATCH) {
+            ok = write_all(fd, iov, count);
+            count = 0;
+        }
+    }
+    if (ok && count > 0) {
+        ok = write_all(fd, iov, count);
+    }
+
+    return (close(fd) == 0) && ok;
+}
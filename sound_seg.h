@@ -9,28 +9,231 @@
 // Forward declaration for the sound segment structure.
 typedef struct sound_seg sound_seg;
 
-// Allocate and initialize a new empty track.
+// Concurrency contract:
+// - A track may be read by any number of threads at once (tr_length, tr_read, the span
+//   iterator, the identification functions, and tr_insert's source), or edited by one
+//   thread, but not both at the same time. Callers serialize access to each track.
+// - tr_snapshot may be called at any time except during tr_destroy of the track, and
+//   snapshots may be read by any thread while the track is being edited.
+// - Different tracks may be used from different threads even when they share samples
+//   through tr_insert; the sharing bookkeeping is atomic or internally locked.
+// - Shared samples are the same memory in every track that holds them, so tr_write to
+//   shared samples must not overlap reads of those samples through another track.
+
+// A track holds frames of one or more channels, stored interleaved: frame i is samples
+// [i * channels, (i + 1) * channels) in every buffer the functions below read or write.
+// All positions and lengths are counted in frames. Tracks of different channel counts
+// cannot be inserted into each other, and an ad only matches targets of its own count.
+
+// Allocate and initialize a new empty track of 8000 Hz mono.
 sound_seg* tr_init();
 
+// Allocate and initialize a new empty track with the given format, or NULL if
+// `channels` is 0.
+sound_seg* tr_init_fmt(uint16_t channels, uint32_t sample_rate);
+
+// Return the number of channels of the track.
+uint16_t tr_channels(const sound_seg* track);
+
+// Return the sample rate of the track in Hz. It is kept for saving and is not
+// otherwise interpreted.
+uint32_t tr_sample_rate(const sound_seg* track);
+
 // Destroy a track and free all associated memory.
 void tr_destroy(sound_seg* track);
 
-// Return the length (in samples) of the track.
+// Return a read-only version of `track` as of its last completed edit, sharing its
+// samples, in O(1). Safe to call while another thread edits the track, and never waits
+// for the edit. Later inserts, deletes and appends do not show in the snapshot; sample
+// values overwritten in place by tr_write do, as for tracks sharing samples via
+// tr_insert. Edits on a snapshot are ignored. Free it with tr_destroy.
+sound_seg* tr_snapshot(sound_seg* track);
+
+// Shape and memory use of one track, as reported by tr_stats.
+// Samples count as shared when a snapshot shares their segment, when a copy inserted
+// elsewhere covers them, or when they are a copy whose source is still held elsewhere;
+// the rest are owned by the track alone.
+typedef struct tr_track_stats {
+    size_t segments;           // runs of contiguous samples the track is made of
+    size_t tree_height;        // longest path through the segment tree
+    size_t span_depth;         // longest chain of tr_insert copies behind one segment
+    size_t copied_segments;    // segments inserted from another track
+    size_t blocks;             // distinct sample blocks referenced
+    size_t mapped_blocks;      // of which are mapped from a file by tr_load_wav
+    size_t bytes_owned;
+    size_t bytes_shared;
+    size_t bytes_allocated;    // size of the referenced blocks, including spare capacity
+} tr_track_stats;
+
+// Describe a track in `out`, in time linear in its segments. The counts are exact for a
+// track no other thread edits meanwhile. Returns false on allocation failure.
+bool tr_stats(const sound_seg* track, tr_track_stats* out);
+
+// Process-wide counts of the events behind the cost of edits and identification.
+// They are kept only when the library is built with SOUND_SEG_STATS defined
+// (make STATS=1), at one relaxed atomic add per event, and read 0 otherwise.
+typedef struct tr_counters {
+    uint64_t splits;           // segments cut in two by edits
+    uint64_t allocations;      // sample blocks and segment and span headers allocated
+    uint64_t lookups;          // descents of a segment tree to find a position
+    uint64_t offsets;          // correlation offsets evaluated by identification
+} tr_counters;
+
+// Read the counters.
+void tr_counters_get(tr_counters* out);
+
+// Set the counters to 0.
+void tr_counters_reset();
+
+// Load a 16-bit PCM WAV file as a new track of its format. The samples are mapped from
+// the file rather than read, and the mapping is released with the last track sharing them.
+// Writes go to private copies of the touched pages; the file is never modified.
+// Returns NULL if the file cannot be mapped or is not in that format.
+sound_seg* tr_load_wav(const char* path);
+
+// Save a track as a 16-bit PCM WAV file of its format, writing its samples straight
+// from where they are stored, without gathering them into one buffer first.
+// Returns false if the file cannot be written or the track exceeds the format's 4 GiB limit.
+bool tr_save_wav(const sound_seg* track, const char* path);
+
+// Return the length (in frames) of the track.
 size_t tr_length(sound_seg* track);
 
-// Read samples from track starting at `pos` into `dest`.
+// Read `len` frames from track starting at `pos` into `dest`.
 void tr_read(sound_seg* track, int16_t* dest, size_t pos, size_t len);
 
-// Write samples from `src` into track starting at `pos`.
+// Iterator over the contiguous runs of samples stored in a track.
+typedef struct tr_span_iter {
+    const sound_seg* track;
+    size_t pos;                // sample positions, counting every channel
+    size_t end;
+} tr_span_iter;
+
+// Start iterating over frames [pos, pos + len) of a track, clamped to its length.
+void tr_span_begin(tr_span_iter* it, const sound_seg* track, size_t pos, size_t len);
+
+// Return a pointer to the next run of frames without copying, storing its length in `len`.
+// Returns NULL once the range is exhausted. The runs stay valid until the track is edited.
+const int16_t* tr_span_next(tr_span_iter* it, size_t* len);
+
+// Write `len` frames from `src` into track starting at `pos`.
 void tr_write(sound_seg* track, const int16_t* src, size_t pos, size_t len);
 
-// Delete a range of samples from the track.
+// Delete a range of frames from the track.
 bool tr_delete_range(sound_seg* track, size_t pos, size_t len);
 
-// Identify occurrences of ad within the target track using cross-correlation.
+// One occurrence of an ad: inclusive start and end frame positions in the target, and
+// the normalized correlation score (window correlation over the ad's own; matches are >= 0.95),
+// or the normalized cross-correlation when tr_identify_ex is asked for it.
+// The correlation of multi-channel audio is the sum of the per-channel correlations.
+typedef struct tr_match {
+    size_t start;
+    size_t end;
+    double score;
+} tr_match;
+
+// Identify occurrences of ad within the target track, storing up to `cap` matches in `out`.
+// Returns the total number of matches (which may exceed `cap`), or SIZE_MAX on allocation failure.
+size_t tr_identify_matches(const sound_seg* target, const sound_seg* ad, tr_match* out, size_t cap);
+
+// How tr_identify_ex decides that a window matches the ad, and where it looks.
+typedef struct tr_identify_opts {
+    bool normalized;           // use the normalized cross-correlation of window and ad
+    double threshold;          // least normalized cross-correlation of a match; 0 means 0.95
+    unsigned coarse_levels;    // halvings of the rate to search at first, up to 8; 0: none
+    double coarse_relax;       // fraction of the threshold a coarse window must reach; 0 means 0.5
+} tr_identify_opts;
+
+// Same as tr_identify_matches, with options; NULL options give the default.
+// Coarse levels search faster but can miss a match alike mostly in high frequencies.
+size_t tr_identify_ex(const sound_seg* target, const sound_seg* ad, const tr_identify_opts* opts,
+                      tr_match* out, size_t cap);
+
+// Identify occurrences of ad as "start,end" lines, one per match.
 char* tr_identify(const sound_seg* target, const sound_seg* ad);
 
+// Same as tr_identify, spreading the correlation over `nthreads` threads (0 = one per CPU).
+char* tr_identify_mt(const sound_seg* target, const sound_seg* ad, size_t nthreads);
+
+// The occurrences found for one ad, in increasing order.
+typedef struct tr_match_list {
+    tr_match* matches;
+    size_t count;
+} tr_match_list;
+
+// Identify each of the `n` ads in `target` with a single pass over the target.
+// Returns `n` match lists, each equal to what tr_identify reports for that ad, or NULL on
+// allocation failure. Free the result with tr_match_lists_free.
+// Only the default correlation is available, without pruning quiet windows.
+tr_match_list* tr_identify_many(const sound_seg* target, const sound_seg* const ads[], size_t n);
+
+// Free the match lists returned by tr_identify_many.
+void tr_match_lists_free(tr_match_list* lists, size_t n);
+
+// Incremental identification of one ad in audio that arrives a chunk at a time.
+// Matches are the same as tr_identify on everything pushed so far, reported at most
+// one correlation block (plus the ad length) after the end of the matching window.
+// Only the default correlation is available, without pruning quiet windows.
+typedef struct tr_identify_stream tr_identify_stream;
+
+// Receives each match, with start and end given as stream positions.
+typedef void (*tr_match_callback)(void* user, const tr_match* match);
+
+// Create a matcher for `ad`. The samples are copied, so the ad track can change later.
+tr_identify_stream* tr_identify_stream_init(const sound_seg* ad);
+
+// Deliver matches to `callback` when found instead of queueing them for polling.
+void tr_identify_stream_on_match(tr_identify_stream* stream, tr_match_callback callback, void* user);
+
+// Feed the next `n` frames of the stream, with the ad's channel count.
+// Returns false on allocation failure.
+bool tr_identify_stream_push(tr_identify_stream* stream, const int16_t* samples, size_t n);
+
+// Evaluate every offset whose window is complete without waiting for a full block.
+bool tr_identify_stream_flush(tr_identify_stream* stream);
+
+// Pop the oldest queued match. Returns false if none is waiting.
+bool tr_identify_stream_poll(tr_identify_stream* stream, tr_match* match);
+
+// Destroy a matcher.
+void tr_identify_stream_destroy(tr_identify_stream* stream);
+
 // Insert a portion from one track (src) into another (dest).
 void tr_insert(sound_seg* src_track, sound_seg* dest_track, size_t destpos, size_t srcpos, size_t len);
 
+// Work limits and resume point of tr_compact. A limit of 0 means none.
+typedef struct tr_compact_policy {
+    size_t copy_below;         // copy runs of segments shorter than this many frames (0: never)
+    size_t max_segments;       // segments to visit in one call
+    uint64_t max_nanoseconds;  // time to spend in one call
+    size_t cursor;             // frame to resume from, advanced by every call
+} tr_compact_policy;
+
+// Defragment a track from `policy->cursor` on until a limit is reached, keeping its samples.
+// Returns the number of segments removed, or SIZE_MAX on allocation failure.
+size_t tr_compact(sound_seg* track, tr_compact_policy* policy);
+
+// A list of inserts and deletes applied to one track together. Every position, and every
+// insert's source, refers to the track as it is before the batch.
+typedef struct tr_batch tr_batch;
+
+// Start a batch of edits to `track`. Returns NULL for a snapshot or on allocation failure.
+// The track must not be edited otherwise until the batch is committed or aborted.
+tr_batch* tr_batch_begin(sound_seg* track);
+
+// Queue an insert of `len` frames of `src_track` from `srcpos` at `destpos`.
+// Returns false on allocation failure, which also makes the commit fail, as does a source
+// with a different channel count.
+bool tr_batch_insert(tr_batch* batch, sound_seg* src_track, size_t destpos, size_t srcpos, size_t len);
+
+// Queue a delete of frames [pos, pos + len). Returns false on allocation failure.
+bool tr_batch_delete(tr_batch* batch, size_t pos, size_t len);
+
+// Apply the queued edits and free the batch. If any edit would fail or two of them
+// conflict, nothing changes and this returns false.
+bool tr_batch_commit(tr_batch* batch);
+
+// Free a batch without applying it.
+void tr_batch_abort(tr_batch* batch);
+
 #endif // SOUND_SEG_H
\ No newline at end of file
@@ -0,0 +1,27 @@
+#define _POSIX_C_SOURCE 200809L
+#include "spinlock.h"
+#include <sched.h>
+
+// Attempts before yielding the CPU to the lock holder
+#define SPIN_LIMIT 64
+
+// Initialize the flag clear
+void spinlock_init(spinlock* lock) {
+    atomic_flag_clear(&lock->flag);
+}
+
+// Spin on the flag, yielding after a short burst so a descheduled holder can finish
+void spin_lock(spinlock* lock) {
+    int spins = 0;
+    while (atomic_flag_test_and_set_explicit(&lock->flag, memory_order_acquire)) {
+        if (++spins == SPIN_LIMIT) {
+            spins = 0;
+            sched_yield();
+        }
+    }
+}
+
+// Clear the flag, publishing the critical section's writes
+void spin_unlock(spinlock* lock) {
+    atomic_flag_clear_explicit(&lock->flag, memory_order_release);
+}
@@ -0,0 +1,20 @@
+#ifndef SPINLOCK_H
+#define SPINLOCK_H
+
+#include <stdatomic.h>
+
+// Test-and-set lock for short critical sections on data shared between tracks.
+typedef struct spinlock {
+    atomic_flag flag;
+} spinlock;
+
+// Initialize an unlocked spinlock.
+void spinlock_init(spinlock* lock);
+
+// Acquire the lock, yielding the CPU while it is contended.
+void spin_lock(spinlock* lock);
+
+// Release the lock.
+void spin_unlock(spinlock* lock);
+
+#endif // SPINLOCK_H
@@ -0,0 +1,252 @@
+// stress.c
+// Concurrency stress test of the contract in sound_seg.h, built with ThreadSanitizer and
+// run by `make tsan`. Editors edit their own tracks, which share samples with a common
+// source and with each other, while readers take snapshots of them and walk those; then
+// the source is edited while the copies of it are deleted and compacted away.
+// Exits with 1 if a snapshot read is inconsistent; races are reported by the sanitizer.
+#define _POSIX_C_SOURCE 200809L
+#include "sound_seg.h"
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <stdio.h>
+#include <pthread.h>
+
+// Threads editing one track each, and threads reading snapshots of every editor's track
+#define STRESS_EDITORS 4
+#define STRESS_READERS 4
+
+// Edits each editor makes in the first phase
+#define STRESS_EDITS 400
+
+// Frames of the shared source track
+#define STRESS_SOURCE_LEN 20000
+
+// State shared by the threads of a run
+typedef struct stress_run {
+    sound_seg* source;                         // only read during the first phase
+    sound_seg* tracks[STRESS_EDITORS];         // each edited by its editor only
+    pthread_barrier_t phase;                   // editors and the main thread
+    atomic_bool done;                          // readers stop once set
+    atomic_int errors;
+} stress_run;
+
+// One thread's view of a run
+typedef struct stress_thread {
+    stress_run* run;
+    size_t id;
+    uint64_t rng;
+} stress_thread;
+
+// Return the next value of a xorshift generator
+uint64_t stress_random(stress_thread* self) {
+    self->rng ^= self->rng << 13;
+    self->rng ^= self->rng >> 7;
+    self->rng ^= self->rng << 17;
+    return self->rng;
+}
+
+// Report a failed check
+void stress_fail(stress_run* run, const char* what) {
+    fprintf(stderr, "stress: %s\n", what);
+    atomic_fetch_add(&run->errors, 1);
+}
+
+// Make one random edit to the editor's own track: inserts from the source, from another
+// editor's snapshot and from itself, deletes, appends and budgeted compaction
+void stress_edit(stress_thread* self, sound_seg* track, tr_compact_policy* policy) {
+    stress_run* run = self->run;
+    uint64_t r = stress_random(self);
+    size_t len = tr_length(track);
+    size_t pos = len ? (r >> 8) % (len + 1) : 0;
+
+    switch (r % 7) {
+    case 0:
+    case 1:
+        tr_insert(run->source, track, pos, (r >> 24) % (STRESS_SOURCE_LEN - 100), 1 + (r >> 40) % 90);
+        break;
+    case 2: {
+        sound_seg* other = tr_snapshot(run->tracks[(self->id + 1) % STRESS_EDITORS]);
+        size_t other_len = tr_length(other);
+        if (other_len > 0) {
+            tr_insert(other, track, pos, (r >> 24) % other_len, 1 + (r >> 40) % 40);
+        }
+        tr_destroy(other);
+        break;
+    }
+    case 3:
+        if (len > 0) {
+            tr_insert(track, track, pos, (r >> 24) % len, 1 + (r >> 40) % 30);
+        }
+        break;
+    case 4:
+        if (len > 0) {
+            tr_delete_range(track, (r >> 24) % len, 1 + (r >> 40) % 40);
+        }
+        break;
+    case 5: {
+        int16_t samples[64];
+        for (size_t i = 0; i < 64; i++) {
+            samples[i] = (int16_t)(stress_random(self) >> 48);
+        }
+        tr_write(track, samples, len, 1 + (r >> 40) % 64);
+        break;
+    }
+    default:
+        if (policy->cursor >= len) {
+            policy->cursor = 0;
+        }
+        if (tr_compact(track, policy) == SIZE_MAX) {
+            stress_fail(run, "tr_compact ran out of memory");
+        }
+        break;
+    }
+}
+
+// Edit the editor's track, then, once the source is being edited too, delete and compact
+// the copies of it away
+void* stress_editor(void* arg) {
+    stress_thread* self = (stress_thread*) arg;
+    stress_run* run = self->run;
+    sound_seg* track = run->tracks[self->id];
+    tr_compact_policy policy = { 32, 16, 0, 0 };
+
+    for (size_t k = 0; k < STRESS_EDITS; k++) {
+        stress_edit(self, track, &policy);
+    }
+
+    pthread_barrier_wait(&run->phase);
+    while (tr_length(track) > 0) {
+        size_t len = tr_length(track);
+        if (!tr_delete_range(track, stress_random(self) % len, 1 + stress_random(self) % 50)) {
+            // Covered by a copy in another editor's track: wait for that one to go
+            policy.cursor = 0;
+            tr_compact(track, &policy);
+        }
+        if (stress_random(self) % 64 == 0) {
+            break;
+        }
+    }
+    pthread_barrier_wait(&run->phase);
+    return NULL;
+}
+
+// Check that a snapshot reads the same through the span iterator and tr_read
+void stress_check_snapshot(stress_run* run, sound_seg* snap) {
+    size_t len = tr_length(snap);
+    size_t channels = tr_channels(snap);
+    int16_t* samples = (int16_t*) malloc((len + 1) * channels * sizeof(int16_t));
+    if (!samples) return;
+    tr_read(snap, samples, 0, len);
+
+    tr_span_iter it;
+    size_t done = 0;
+    size_t run_len = 0;
+    const int16_t* data;
+    tr_span_begin(&it, snap, 0, len);
+    while ((data = tr_span_next(&it, &run_len))) {
+        size_t bytes = run_len * channels * sizeof(int16_t);
+        if (done + run_len > len || memcmp(data, samples + done * channels, bytes) != 0) {
+            stress_fail(run, "span iterator and tr_read disagree on a snapshot");
+            break;
+        }
+        done += run_len;
+    }
+    if (done != len) {
+        stress_fail(run, "span iterator does not cover a snapshot");
+    }
+    free(samples);
+}
+
+// Take snapshots of the editors' tracks while they are edited and read them every way
+// the contract allows, including identification with cached pyramids
+void* stress_reader(void* arg) {
+    stress_thread* self = (stress_thread*) arg;
+    stress_run* run = self->run;
+
+    while (!atomic_load(&run->done)) {
+        sound_seg* snap = tr_snapshot(run->tracks[stress_random(self) % STRESS_EDITORS]);
+        stress_check_snapshot(run, snap);
+
+        tr_track_stats stats;
+        if (!tr_stats(snap, &stats)) {
+            stress_fail(run, "tr_stats ran out of memory");
+        }
+
+        size_t len = tr_length(snap);
+        if (len > 512 && stress_random(self) % 8 == 0) {
+            sound_seg* ad = tr_init();
+            tr_insert(snap, ad, 0, stress_random(self) % (len - 256), 256);
+            tr_identify_opts opts = { false, 0.0, 2, 0.0 };
+            if (tr_identify_ex(snap, ad, &opts, NULL, 0) == SIZE_MAX) {
+                stress_fail(run, "tr_identify_ex ran out of memory");
+            }
+            tr_destroy(ad);
+        }
+        tr_destroy(snap);
+    }
+    return NULL;
+}
+
+int main() {
+    stress_run run;
+    run.source = tr_init();
+    int16_t* samples = (int16_t*) malloc(STRESS_SOURCE_LEN * sizeof(int16_t));
+    stress_thread seed = { &run, 0, 0x9e3779b97f4a7c15ull };
+    for (size_t i = 0; i < STRESS_SOURCE_LEN; i++) {
+        samples[i] = (int16_t)(stress_random(&seed) >> 48);
+    }
+    tr_write(run.source, samples, 0, STRESS_SOURCE_LEN);
+    free(samples);
+    for (size_t i = 0; i < STRESS_EDITORS; i++) {
+        run.tracks[i] = tr_init();
+        tr_insert(run.source, run.tracks[i], 0, i * 1000, 1000);
+    }
+    pthread_barrier_init(&run.phase, NULL, STRESS_EDITORS + 1);
+    atomic_init(&run.done, false);
+    atomic_init(&run.errors, 0);
+
+    pthread_t editors[STRESS_EDITORS];
+    pthread_t readers[STRESS_READERS];
+    stress_thread threads[STRESS_EDITORS + STRESS_READERS];
+    for (size_t i = 0; i < STRESS_EDITORS + STRESS_READERS; i++) {
+        threads[i].run = &run;
+        threads[i].id = i;
+        threads[i].rng = 0x2545f4914f6cdd1dull * (i + 1);
+    }
+    for (size_t i = 0; i < STRESS_EDITORS; i++) {
+        pthread_create(&editors[i], NULL, stress_editor, &threads[i]);
+    }
+    for (size_t i = 0; i < STRESS_READERS; i++) {
+        pthread_create(&readers[i], NULL, stress_reader, &threads[STRESS_EDITORS + i]);
+    }
+
+    // Second phase: delete from the source while the editors drop their copies of it
+    pthread_barrier_wait(&run.phase);
+    size_t deleted = 0;
+    for (size_t k = 0; k < 2000 && tr_length(run.source) > 10; k++) {
+        deleted += tr_delete_range(run.source, (k * 37) % (tr_length(run.source) - 5), 5);
+    }
+    pthread_barrier_wait(&run.phase);
+
+    atomic_store(&run.done, true);
+    for (size_t i = 0; i < STRESS_EDITORS; i++) {
+        pthread_join(editors[i], NULL);
+    }
+    for (size_t i = 0; i < STRESS_READERS; i++) {
+        pthread_join(readers[i], NULL);
+    }
+
+    for (size_t i = 0; i < STRESS_EDITORS; i++) {
+        tr_destroy(run.tracks[i]);
+    }
+    tr_destroy(run.source);
+    pthread_barrier_destroy(&run.phase);
+
+    int errors = atomic_load(&run.errors);
+    printf("stress: %zu source deletes succeeded, %d errors\n", deleted, errors);
+    return errors ? 1 : 0;
+}
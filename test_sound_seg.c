@@ -0,0 +1,1190 @@
+// test_sound_seg.c
+// Regression tests of the sound_seg library. Built and run by `make test`; each test
+// prints its name and a failure line per broken expectation, and the exit status is the
+// number of failed tests.
+#define _POSIX_C_SOURCE 200809L
+#include "sound_seg.h"
+#include "dot_kernels.h"
+#include "wav_utils.h"
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <unistd.h>
+
+// Expectations that failed in the running test
+int test_failures = 0;
+
+// Record a failed expectation
+#define EXPECT(cond)                                                             \
+    do {                                                                         \
+        if (!(cond)) {                                                           \
+            printf("  %s:%d: expected %s\n", __FILE__, __LINE__, #cond);       \
+            test_failures++;                                                     \
+        }                                                                        \
+    } while (0)
+
+// Step a linear congruential generator and return its top 32 bits
+uint32_t test_next(uint64_t* state) {
+    *state = *state * 6364136223846793005ull + 1442695040888963407ull;
+    return (uint32_t)(*state >> 32);
+}
+
+// Fill `samples` with `len` reproducible noise samples
+void test_noise(int16_t* samples, size_t len, uint64_t seed) {
+    for (size_t i = 0; i < len; i++) {
+        samples[i] = (int16_t) test_next(&seed);
+    }
+}
+
+// Return a track holding `len` samples written in one call
+sound_seg* test_track_of(const int16_t* samples, size_t len) {
+    sound_seg* track = tr_init();
+    tr_write(track, samples, 0, len);
+    return track;
+}
+
+// Check that a track holds exactly `len` samples `expected`
+bool test_holds(sound_seg* track, const int16_t* expected, size_t len) {
+    if (tr_length(track) != len) {
+        return false;
+    }
+    int16_t* samples = (int16_t*) malloc((len + 1) * sizeof(int16_t));
+    tr_read(track, samples, 0, len);
+    bool same = memcmp(samples, expected, len * sizeof(int16_t)) == 0;
+    free(samples);
+    return same;
+}
+
+// Random appends, inserts and deletes split and merge the segment index into thousands of
+// pieces; the track must always read like a flat array edited the same way
+void test_edits_match_model() {
+    size_t source_len = 1 << 16;
+    size_t cap = 1 << 17;
+    int16_t* source_samples = (int16_t*) malloc(source_len * sizeof(int16_t));
+    test_noise(source_samples, source_len, 1);
+    sound_seg* source = test_track_of(source_samples, source_len);
+    sound_seg* track = tr_init();
+    int16_t* model = (int16_t*) malloc(cap * sizeof(int16_t));
+    int16_t* read = (int16_t*) malloc(cap * sizeof(int16_t));
+    size_t len = 0;
+    uint64_t rng = 2;
+
+    for (size_t k = 0; k < 3000; k++) {
+        uint32_t r = test_next(&rng);
+        size_t pos = len ? test_next(&rng) % (len + 1) : 0;
+        size_t n = 1 + test_next(&rng) % 64;
+        if (len > 0 && (r % 4 == 0 || len + n > cap)) {
+            // Delete; copies from the source never have copies of their own
+            pos %= len;
+            n = (len - pos < n) ? len - pos : n;
+            EXPECT(tr_delete_range(track, pos, n));
+            memmove(model + pos, model + pos + n, (len - pos - n) * sizeof(int16_t));
+            len -= n;
+        } else if (r % 4 == 1) {
+            // Append fresh samples
+            int16_t fresh[64];
+            test_noise(fresh, n, r);
+            tr_write(track, fresh, len, n);
+            memcpy(model + len, fresh, n * sizeof(int16_t));
+            len += n;
+        } else {
+            // Insert a piece of the source anywhere
+            size_t srcpos = test_next(&rng) % (source_len - n);
+            tr_insert(source, track, pos, srcpos, n);
+            memmove(model + pos + n, model + pos, (len - pos) * sizeof(int16_t));
+            memcpy(model + pos, source_samples + srcpos, n * sizeof(int16_t));
+            len += n;
+        }
+        EXPECT(tr_length(track) == len);
+
+        // Read a random range, and the whole track now and then
+        size_t from = len ? test_next(&rng) % len : 0;
+        size_t count = len ? test_next(&rng) % (len - from + 1) : 0;
+        tr_read(track, read, from, count);
+        EXPECT(memcmp(read, model + from, count * sizeof(int16_t)) == 0);
+        if (k % 500 == 0) {
+            EXPECT(test_holds(track, model, len));
+        }
+    }
+    EXPECT(test_holds(track, model, len));
+    EXPECT(test_holds(source, source_samples, source_len));
+
+    free(read);
+    free(model);
+    free(source_samples);
+    tr_destroy(track);
+    tr_destroy(source);
+}
+
+// Return the matches of the original tr_identify: a double-precision dot product at every
+// offset, the 0.95 * reference threshold and a skip past each match
+char* test_naive_identify(const int16_t* target, size_t target_len, const int16_t* ad,
+                          size_t ad_len) {
+    char* results = (char*) malloc(target_len / ad_len * 48 + 1);
+    size_t length = 0;
+    results[0] = '\0';
+    double reference = 0.0;
+    for (size_t i = 0; i < ad_len; i++) {
+        reference += (double)ad[i] * (double)ad[i];
+    }
+    reference /= ad_len;
+    for (size_t pos = 0; pos + ad_len <= target_len; pos++) {
+        double correlation = 0.0;
+        for (size_t i = 0; i < ad_len; i++) {
+            correlation += (double)target[pos + i] * (double)ad[i];
+        }
+        if (correlation / ad_len >= 0.95 * reference) {
+            length += sprintf(results + length, "%s%zu,%zu", length ? "\n" : "", pos,
+                              pos + ad_len - 1);
+            pos += ad_len - 1;
+        }
+    }
+    return results;
+}
+
+// Return the exact dot product of two int16 vectors
+int64_t test_dot(const int16_t* a, const int16_t* b, size_t len) {
+    int64_t dot = 0;
+    for (size_t i = 0; i < len; i++) {
+        dot += (int64_t)a[i] * b[i];
+    }
+    return dot;
+}
+
+// Overwrite `window` with a copy of `ad` whose dot product with the ad is exactly `dot`,
+// by zeroing samples and then trimming the ad's unit samples (its first `units`)
+void test_window_with_dot(int16_t* window, const int16_t* ad, size_t ad_len, size_t units,
+                          int64_t dot) {
+    memcpy(window, ad, ad_len * sizeof(int16_t));
+    int64_t excess = test_dot(ad, ad, ad_len) - dot;
+    for (size_t i = units; i < ad_len && excess > 0; i++) {
+        if ((int64_t)ad[i] * ad[i] <= excess) {
+            excess -= (int64_t)ad[i] * ad[i];
+            window[i] = 0;
+        }
+    }
+    for (size_t i = 0; i < units && excess > 0; i++) {
+        int64_t trim = excess < 32768 ? excess : 32768;
+        window[i] = (int16_t)(1 - trim);
+        excess -= trim;
+    }
+}
+
+// The FFT correlator only estimates dot products; windows whose exact dot product sits
+// on either side of the threshold, within the estimate's error bound, must still be
+// decided like the original double-precision scan
+void test_fft_matches_naive_scan() {
+    size_t ad_len = 1000;
+    size_t units = 16;
+    size_t target_len = 1 << 15;
+    int16_t* ad = (int16_t*) malloc(ad_len * sizeof(int16_t));
+    int16_t* target = (int16_t*) malloc(target_len * sizeof(int16_t));
+    test_noise(ad, ad_len, 3);
+    test_noise(target, target_len, 4);
+    for (size_t i = 0; i < target_len; i++) {
+        target[i] = (int16_t)(target[i] / 16);
+        if (i < ad_len) {
+            ad[i] = (int16_t)(ad[i] / 16);
+        }
+    }
+    for (size_t i = 0; i < units; i++) {
+        ad[i] = 1;
+    }
+
+    // The threshold on the dot product is 0.95 of the ad's energy; plant windows just
+    // below, at and just above it, and two exact copies
+    int64_t threshold = (int64_t)(0.95 * (double)test_dot(ad, ad, ad_len));
+    int64_t offsets[] = { -2, -1, 0, 1, 2 };
+    size_t at = 1500;
+    for (size_t k = 0; k < sizeof(offsets) / sizeof(offsets[0]); k++, at += 4000) {
+        test_window_with_dot(target + at, ad, ad_len, units, threshold + offsets[k]);
+        EXPECT(test_dot(target + at, ad, ad_len) == threshold + offsets[k]);
+    }
+    memcpy(target + at, ad, ad_len * sizeof(int16_t));
+    memcpy(target + target_len - ad_len, ad, ad_len * sizeof(int16_t));
+
+    sound_seg* target_track = test_track_of(target, target_len);
+    sound_seg* ad_track = test_track_of(ad, ad_len);
+    char* expected = test_naive_identify(target, target_len, ad, ad_len);
+    char* found = tr_identify(target_track, ad_track);
+    EXPECT(strcmp(found, expected) == 0);
+
+    // The windows above the threshold and the two copies
+    size_t matches = 1;
+    for (const char* c = expected; *c; c++) {
+        matches += *c == '\n';
+    }
+    EXPECT(matches == 4);
+
+    free(found);
+    free(expected);
+    tr_destroy(ad_track);
+    tr_destroy(target_track);
+    free(target);
+    free(ad);
+}
+
+// The vector kernels fix up int32 lanes that wrap to INT32_MIN when both pairs of a
+// pmaddwd are -32768 * -32768; every kernel must agree with the scalar one on vectors
+// full of such pairs, at every length around the vector widths
+void test_dot_kernels_exact() {
+    static const char* names[] = { "sse2", "avx2", "avx512" };
+    static const dot_kernel kernels[] = { dot_i16_sse2, dot_i16_avx2, dot_i16_avx512 };
+    size_t max_len = 300;
+    int16_t* a = (int16_t*) malloc(max_len * sizeof(int16_t));
+    int16_t* b = (int16_t*) malloc(max_len * sizeof(int16_t));
+    uint64_t rng = 5;
+
+    for (int fill = 0; fill < 3; fill++) {
+        for (size_t i = 0; i < max_len; i++) {
+            uint32_t r = test_next(&rng);
+            // All -32768, noise, or noise with runs of -32768 pairs
+            bool extreme = fill == 0 || (fill == 2 && (r >> 8) % 3 != 0);
+            a[i] = extreme ? INT16_MIN : (int16_t) r;
+            b[i] = extreme ? INT16_MIN : (int16_t)(r >> 16);
+        }
+        for (size_t len = 0; len <= max_len; len++) {
+            int64_t expected = dot_i16_scalar(a, b, len);
+            for (size_t k = 0; k < sizeof(names) / sizeof(names[0]); k++) {
+                if (dot_kernel_supported(names[k])) {
+                    EXPECT(kernels[k](a, b, len) == expected);
+                }
+            }
+        }
+    }
+    EXPECT(dot_i16_scalar(a, a, 0) == 0);
+    for (size_t i = 0; i < max_len; i++) {
+        a[i] = INT16_MIN;
+    }
+    EXPECT(dot_i16_scalar(a, a, max_len) == (int64_t)max_len << 30);
+
+    free(a);
+    free(b);
+}
+
+// Fill `target` with noise and plant copies of `ad` at random gaps, some of them closer
+// than the ad's length so that a match hides part of the next copy
+void test_plant(int16_t* target, size_t target_len, const int16_t* ad, size_t ad_len,
+                uint64_t seed) {
+    test_noise(target, target_len, seed);
+    size_t pos = test_next(&seed) % ad_len;
+    while (pos + ad_len <= target_len) {
+        memcpy(target + pos, ad, ad_len * sizeof(int16_t));
+        pos += ad_len / 3 + test_next(&seed) % (3 * ad_len);
+    }
+}
+
+// Splitting the offsets among threads, whose chunks overlap by the ad's length, must not
+// change which matches the greedy skip keeps, on the direct path or the FFT path
+void test_identify_mt_matches_identify() {
+    static const size_t ad_lens[] = { 50, 700 };
+    static const size_t threads[] = { 0, 1, 2, 3, 8 };
+    size_t target_len = 1 << 17;
+    int16_t* target = (int16_t*) malloc(target_len * sizeof(int16_t));
+    int16_t ad[700];
+
+    for (size_t a = 0; a < sizeof(ad_lens) / sizeof(ad_lens[0]); a++) {
+        test_noise(ad, ad_lens[a], 10 + a);
+        test_plant(target, target_len, ad, ad_lens[a], 20 + a);
+        sound_seg* target_track = test_track_of(target, target_len);
+        sound_seg* ad_track = test_track_of(ad, ad_lens[a]);
+
+        char* expected = tr_identify(target_track, ad_track);
+        EXPECT(strlen(expected) > 0);
+        for (size_t t = 0; t < sizeof(threads) / sizeof(threads[0]); t++) {
+            char* found = tr_identify_mt(target_track, ad_track, threads[t]);
+            EXPECT(strcmp(found, expected) == 0);
+            free(found);
+        }
+        free(expected);
+        tr_destroy(ad_track);
+        tr_destroy(target_track);
+    }
+    free(target);
+}
+
+// Matches collected in tr_identify's format
+typedef struct test_matches {
+    char text[1 << 16];
+    size_t length;
+} test_matches;
+
+// Append a match to a collection
+void test_collect(void* user, const tr_match* match) {
+    test_matches* matches = (test_matches*) user;
+    matches->length += snprintf(matches->text + matches->length,
+                                sizeof(matches->text) - matches->length, "%s%zu,%zu",
+                                matches->length ? "\n" : "", match->start, match->end);
+}
+
+// Pushing a target in uneven pieces, with flushes in between, must report the same
+// matches as tr_identify on the whole target, through polling or the callback
+void test_stream_matches_identify() {
+    static const size_t ad_lens[] = { 50, 700 };
+    size_t target_len = 1 << 17;
+    int16_t* target = (int16_t*) malloc(target_len * sizeof(int16_t));
+    int16_t ad[700];
+    test_matches* polled = (test_matches*) calloc(1, sizeof(test_matches));
+    test_matches* called = (test_matches*) calloc(1, sizeof(test_matches));
+    uint64_t rng = 30;
+
+    for (size_t a = 0; a < sizeof(ad_lens) / sizeof(ad_lens[0]); a++) {
+        test_noise(ad, ad_lens[a], 31 + a);
+        test_plant(target, target_len, ad, ad_lens[a], 33 + a);
+        sound_seg* target_track = test_track_of(target, target_len);
+        sound_seg* ad_track = test_track_of(ad, ad_lens[a]);
+        char* expected = tr_identify(target_track, ad_track);
+        EXPECT(strlen(expected) > 0);
+        tr_identify_stream* poll_stream = tr_identify_stream_init(ad_track);
+        tr_identify_stream* call_stream = tr_identify_stream_init(ad_track);
+        tr_identify_stream_on_match(call_stream, test_collect, called);
+        polled->length = called->length = 0;
+        size_t pos = 0;
+        while (pos < target_len) {
+            uint32_t r = test_next(&rng);
+            size_t n = (r % 4 == 0) ? 1 : 1 + r % 5000;
+            n = (n > target_len - pos) ? target_len - pos : n;
+            EXPECT(tr_identify_stream_push(poll_stream, target + pos, n));
+            EXPECT(tr_identify_stream_push(call_stream, target + pos, n));
+            if (r % 7 == 0) {
+                EXPECT(tr_identify_stream_flush(poll_stream));
+            }
+            tr_match match;
+            while (tr_identify_stream_poll(poll_stream, &match)) {
+                test_collect(polled, &match);
+            }
+            pos += n;
+        }
+        EXPECT(tr_identify_stream_flush(poll_stream));
+        EXPECT(tr_identify_stream_flush(call_stream));
+        tr_match match;
+        while (tr_identify_stream_poll(poll_stream, &match)) {
+            test_collect(polled, &match);
+        }
+        EXPECT(strcmp(polled->text, expected) == 0);
+        EXPECT(strcmp(called->text, expected) == 0);
+
+        tr_identify_stream_destroy(call_stream);
+        tr_identify_stream_destroy(poll_stream);
+        free(expected);
+        tr_destroy(ad_track);
+        tr_destroy(target_track);
+    }
+    free(called);
+    free(polled);
+    free(target);
+}
+
+// Scanning for a library of ads at once must find, for each ad, exactly what tr_identify
+// finds for it alone: ads of different lengths on both paths, overlapping occurrences of
+// different ads and an ad that does not occur
+void test_identify_many_matches_identify() {
+    static const size_t ad_lens[] = { 50, 700, 700, 130, 2000, 64 };
+    size_t n = sizeof(ad_lens) / sizeof(ad_lens[0]);
+    size_t target_len = 1 << 17;
+    int16_t* target = (int16_t*) malloc(target_len * sizeof(int16_t));
+    int16_t ads[6][2000];
+    sound_seg* ad_tracks[6];
+    uint64_t rng = 40;
+
+    test_noise(target, target_len, 41);
+    for (size_t a = 0; a < n; a++) {
+        test_noise(ads[a], ad_lens[a], 42 + a);
+        ad_tracks[a] = test_track_of(ads[a], ad_lens[a]);
+    }
+    // Every ad but the last occurs; later copies may overwrite part of earlier ones
+    for (size_t k = 0; k < 120; k++) {
+        size_t a = test_next(&rng) % (n - 1);
+        size_t pos = test_next(&rng) % (target_len - ad_lens[a]);
+        memcpy(target + pos, ads[a], ad_lens[a] * sizeof(int16_t));
+    }
+    sound_seg* target_track = test_track_of(target, target_len);
+
+    tr_match_list* lists = tr_identify_many(target_track, (const sound_seg* const*) ad_tracks, n);
+    EXPECT(lists != NULL);
+    test_matches* found = (test_matches*) calloc(1, sizeof(test_matches));
+    for (size_t a = 0; lists && a < n; a++) {
+        found->length = 0;
+        found->text[0] = '\0';
+        for (size_t m = 0; m < lists[a].count; m++) {
+            test_collect(found, &lists[a].matches[m]);
+        }
+        char* expected = tr_identify(target_track, ad_tracks[a]);
+        EXPECT(strcmp(found->text, expected) == 0);
+        EXPECT((lists[a].count > 0) == (a != n - 1));
+        free(expected);
+    }
+    tr_match_lists_free(lists, n);
+
+    free(found);
+    for (size_t a = 0; a < n; a++) {
+        tr_destroy(ad_tracks[a]);
+    }
+    tr_destroy(target_track);
+    free(target);
+}
+
+// Appends after a piece inserted from a large track must not size their blocks from the
+// inserted block: alternating small inserts and appends keeps memory near the samples held
+void test_append_after_insert() {
+    size_t rounds = 200;
+    size_t inserted = 16;
+    size_t appended = 160;
+    size_t src_len = 1 << 20;
+    int16_t* samples = (int16_t*) malloc(src_len * sizeof(int16_t));
+    test_noise(samples, src_len, 1);
+    sound_seg* src = test_track_of(samples, src_len);
+    sound_seg* track = tr_init();
+    int16_t chunk[160];
+    memset(chunk, 0, sizeof(chunk));
+
+    for (size_t r = 0; r < rounds; r++) {
+        tr_insert(src, track, tr_length(track), r * 1000, inserted);
+        tr_write(track, chunk, tr_length(track), appended);
+    }
+    EXPECT(tr_length(track) == rounds * (inserted + appended));
+
+    tr_track_stats src_stats, stats;
+    EXPECT(tr_stats(src, &src_stats));
+    EXPECT(tr_stats(track, &stats));
+    size_t own_bytes = stats.bytes_allocated - src_stats.bytes_allocated;
+    EXPECT(stats.bytes_allocated >= src_stats.bytes_allocated);
+    EXPECT(own_bytes <= 4 * rounds * appended * sizeof(int16_t));
+
+    tr_destroy(track);
+    tr_destroy(src);
+    free(samples);
+}
+
+// Samples copied by tr_insert cannot be deleted from their source while any copy, or a
+// copy of a copy, covers them; deleting the copies withdraws the cover piece by piece
+void test_cover_protects_source() {
+    size_t len = 1000;
+    int16_t samples[1000];
+    test_noise(samples, len, 50);
+    sound_seg* source = test_track_of(samples, len);
+    sound_seg* copy = tr_init();
+    sound_seg* nested = tr_init();
+
+    // copy holds source[200, 300) and nested holds source[250, 270) through copy
+    tr_insert(source, copy, 0, 200, 100);
+    tr_insert(copy, nested, 0, 50, 20);
+    EXPECT(!tr_delete_range(source, 200, 100));
+    EXPECT(!tr_delete_range(source, 150, 51));
+    EXPECT(!tr_delete_range(source, 299, 10));
+    EXPECT(!tr_delete_range(copy, 50, 20));
+    EXPECT(test_holds(source, samples, len));
+
+    // Outside the cover everything can go
+    EXPECT(tr_delete_range(source, 300, 700));
+    EXPECT(tr_delete_range(source, 0, 200));
+    EXPECT(test_holds(source, samples + 200, 100));
+
+    // A write through the nested copy reaches all three tracks
+    int16_t marker[20];
+    memset(marker, 0x5a, sizeof(marker));
+    tr_write(nested, marker, 0, 20);
+    memcpy(samples + 250, marker, sizeof(marker));
+    EXPECT(test_holds(copy, samples + 200, 100));
+    EXPECT(test_holds(source, samples + 200, 100));
+
+    // Withdrawing copy's cover leaves only the part nested still covers in copy
+    EXPECT(tr_delete_range(copy, 70, 30));
+    EXPECT(tr_delete_range(copy, 0, 50));
+    EXPECT(!tr_delete_range(source, 0, 100));
+    EXPECT(!tr_delete_range(source, 50, 20));
+    EXPECT(tr_delete_range(source, 0, 50));
+    tr_destroy(nested);
+    EXPECT(!tr_delete_range(source, 0, 20));
+    tr_destroy(copy);
+    EXPECT(tr_delete_range(source, 0, 50));
+    EXPECT(tr_length(source) == 0);
+    tr_destroy(source);
+}
+
+// Append 64-sample chunks of value 0, 1, 2, ... to a track, so every version of it is
+// a run of whole chunks
+void* test_append_chunks(void* arg) {
+    sound_seg* track = (sound_seg*) arg;
+    int16_t chunk[64];
+    for (int16_t value = 0; value < 2000; value++) {
+        for (size_t i = 0; i < 64; i++) {
+            chunk[i] = value;
+        }
+        tr_write(track, chunk, tr_length(track), 64);
+        if (value % 3 == 0) {
+            tr_delete_range(track, 0, 64);
+            tr_insert(track, track, 0, tr_length(track) - 64, 64);
+        }
+    }
+    return NULL;
+}
+
+// A snapshot keeps the length and layout of the version it was taken from while the
+// track is edited, sees in-place writes, ignores its own edits and outlives the track;
+// snapshots taken while another thread edits always hold a whole version
+void test_snapshot_isolation() {
+    int16_t samples[300];
+    test_noise(samples, 300, 60);
+    sound_seg* track = test_track_of(samples, 200);
+    sound_seg* snap = tr_snapshot(track);
+
+    tr_write(track, samples + 200, 200, 100);
+    tr_insert(track, track, 0, 150, 50);
+    EXPECT(tr_delete_range(track, 60, 40));
+    EXPECT(test_holds(snap, samples, 200));
+
+    int16_t marker[10];
+    memset(marker, 0x33, sizeof(marker));
+    tr_write(track, marker, 50, 10);
+    memcpy(samples, marker, sizeof(marker));
+    EXPECT(test_holds(snap, samples, 200));
+
+    tr_write(snap, samples + 200, 200, 10);
+    EXPECT(!tr_delete_range(snap, 0, 10));
+    EXPECT(test_holds(snap, samples, 200));
+    tr_destroy(track);
+    EXPECT(test_holds(snap, samples, 200));
+    tr_destroy(snap);
+
+    // Every version of the concurrently edited track is a run of whole, uniform chunks
+    track = tr_init();
+    pthread_t editor;
+    pthread_create(&editor, NULL, test_append_chunks, track);
+    int16_t* read = (int16_t*) malloc(2000 * 64 * sizeof(int16_t));
+    for (size_t k = 0; k < 200; k++) {
+        snap = tr_snapshot(track);
+        size_t len = tr_length(snap);
+        tr_read(snap, read, 0, len);
+        EXPECT(len % 64 == 0);
+        for (size_t i = 0; i < len; i += 64) {
+            EXPECT(memcmp(read + i, read + i + 1, 63 * sizeof(int16_t)) == 0);
+        }
+        tr_destroy(snap);
+    }
+    pthread_join(editor, NULL);
+    free(read);
+    tr_destroy(track);
+}
+
+// Return a track holding 0, 1, ..., len - 1
+sound_seg* test_ramp(size_t len) {
+    sound_seg* track = tr_init();
+    for (size_t i = 0; i < len; i++) {
+        int16_t sample = (int16_t)i;
+        tr_write(track, &sample, i, 1);
+    }
+    return track;
+}
+
+// An insert from the track itself copies its source as it was before the batch, even when
+// the source lies above a delete and an insert of the same batch, which move it
+void test_batch_self_insert() {
+    sound_seg* track = test_ramp(100);
+    tr_batch* batch = tr_batch_begin(track);
+    EXPECT(tr_batch_delete(batch, 10, 10));
+    EXPECT(tr_batch_insert(batch, track, 30, 90, 3));
+    EXPECT(tr_batch_insert(batch, track, 0, 50, 5));
+    EXPECT(tr_batch_commit(batch));
+
+    // 50..54, then 0..9, 20..29, 90..92 and 30..99
+    int16_t expected[98];
+    size_t n = 0;
+    for (int i = 50; i < 55; i++) expected[n++] = (int16_t)i;
+    for (int i = 0; i < 10; i++) expected[n++] = (int16_t)i;
+    for (int i = 20; i < 30; i++) expected[n++] = (int16_t)i;
+    for (int i = 90; i < 93; i++) expected[n++] = (int16_t)i;
+    for (int i = 30; i < 100; i++) expected[n++] = (int16_t)i;
+    EXPECT(test_holds(track, expected, n));
+
+    // The copies share the pre-batch samples, so deleting their sources must fail
+    EXPECT(!tr_delete_range(track, 5 + 10 + 10 + 3 + 20, 5));
+    tr_destroy(track);
+}
+
+// Store a per-process path for a scratch WAV file in `path` of 128 bytes
+void test_wav_path(char* path, const char* name) {
+    snprintf(path, 128, "/tmp/test_sound_seg_%ld_%s.wav", (long)getpid(), name);
+}
+
+// Append a little-endian field of `bytes` bytes
+unsigned char* test_put(unsigned char* p, uint32_t value, int bytes) {
+    for (int i = 0; i < bytes; i++) {
+        *p++ = (unsigned char)(value >> (8 * i));
+    }
+    return p;
+}
+
+// Write a WAV file the way other tools do: a WAVE_FORMAT_EXTENSIBLE `fmt ` chunk, an
+// odd-sized chunk with its pad byte before the data and another after it
+void test_write_extensible(const char* path, const int16_t* samples, size_t frames,
+                           uint16_t channels, uint32_t rate) {
+    size_t data_bytes = frames * channels * sizeof(int16_t);
+    unsigned char* file = (unsigned char*) malloc(data_bytes + 128);
+    unsigned char* p = file;
+    memcpy(p, "RIFF", 4);
+    p = test_put(p + 4, 0, 4);
+    memcpy(p, "WAVE", 4);
+    memcpy(p + 4, "fmt ", 4);
+    p = test_put(p + 8, 40, 4);
+    p = test_put(p, 0xFFFE, 2);
+    p = test_put(p, channels, 2);
+    p = test_put(p, rate, 4);
+    p = test_put(p, rate * channels * 2, 4);
+    p = test_put(p, channels * 2, 2);
+    p = test_put(p, 16, 2);
+    p = test_put(p, 22, 2);
+    p = test_put(p, 16, 2);
+    p = test_put(p, 3, 4);
+    p = test_put(p, WAV_FORMAT_PCM, 2);
+    memcpy(p, "\x00\x00\x00\x00\x10\x00\x80\x00\x00\xaa\x00\x38\x9b\x71", 14);
+    memcpy(p + 14, "LIST", 4);
+    p = test_put(p + 18, 5, 4);
+    memcpy(p, "abcde\0", 6);
+    memcpy(p + 6, "data", 4);
+    p = test_put(p + 10, (uint32_t)data_bytes, 4);
+    for (size_t i = 0; i < frames * channels; i++) {
+        p = test_put(p, (uint16_t)samples[i], 2);
+    }
+    memcpy(p, "junk", 4);
+    p = test_put(p + 4, 3, 4);
+    memcpy(p, "xyz\0", 4);
+    p += 4;
+    test_put(file + 4, (uint32_t)(p - file - 8), 4);
+
+    FILE* out = fopen(path, "wb");
+    fwrite(file, 1, p - file, out);
+    fclose(out);
+    free(file);
+}
+
+// Read a whole stream in pieces of `piece` frames and compare it with `expected`
+bool test_stream_holds(wav_stream* wav, const int16_t* expected, size_t frames, size_t piece) {
+    size_t channels = wav_stream_format(wav).channels;
+    int16_t* samples = (int16_t*) malloc((frames + piece) * channels * sizeof(int16_t));
+    size_t done = 0;
+    size_t got;
+    while ((got = wav_stream_read(wav, samples + done * channels, piece)) > 0) {
+        done += got;
+    }
+    bool same = done == frames && memcmp(samples, expected, frames * channels * sizeof(int16_t)) == 0;
+    free(samples);
+    return same;
+}
+
+// Files from other tools, with an extensible header and odd-sized chunks, stream in with
+// their format and frame count; streamed writes read back the same, also through
+// wav_load; and a data chunk longer than the file is cut to the frames present
+void test_wav_stream_round_trip() {
+    size_t frames = 10007;
+    int16_t* samples = (int16_t*) malloc(frames * 2 * sizeof(int16_t));
+    int16_t* loaded = (int16_t*) malloc(frames * 2 * sizeof(int16_t));
+    test_noise(samples, frames * 2, 70);
+    char path[128];
+    test_wav_path(path, "stream");
+
+    test_write_extensible(path, samples, frames, 2, 48000);
+    wav_stream* wav = wav_stream_open_read(path);
+    EXPECT(wav != NULL);
+    if (wav) {
+        wav_format format = wav_stream_format(wav);
+        EXPECT(format.audio_format == WAV_FORMAT_PCM && format.channels == 2);
+        EXPECT(format.sample_rate == 48000 && format.bits_per_sample == 16);
+        EXPECT(wav_stream_frames(wav) == frames);
+        EXPECT(test_stream_holds(wav, samples, frames, 333));
+        EXPECT(wav_stream_close(wav));
+    }
+
+    // Write mono in uneven pieces, then read it back every way
+    wav_format mono = { WAV_FORMAT_PCM, 1, 22050, 16 };
+    wav = wav_stream_open_write(path, &mono);
+    size_t done = 0;
+    for (size_t piece = 1; done < frames * 2; piece = piece * 3 + 1) {
+        size_t n = (piece < frames * 2 - done) ? piece : frames * 2 - done;
+        EXPECT(wav_stream_write(wav, samples + done, n));
+        done += n;
+    }
+    EXPECT(wav_stream_frames(wav) == frames * 2);
+    EXPECT(wav_stream_close(wav));
+    wav = wav_stream_open_read(path);
+    EXPECT(wav != NULL);
+    if (wav) {
+        EXPECT(wav_stream_format(wav).sample_rate == 22050);
+        EXPECT(test_stream_holds(wav, samples, frames * 2, 4096));
+        wav_stream_close(wav);
+    }
+    memset(loaded, 0, frames * 2 * sizeof(int16_t));
+    wav_load(path, loaded);
+    EXPECT(memcmp(loaded, samples, frames * 2 * sizeof(int16_t)) == 0);
+
+    // wav_save keeps writing 8000 Hz mono
+    wav_save(path, samples, 1000);
+    wav = wav_stream_open_read(path);
+    EXPECT(wav != NULL);
+    if (wav) {
+        EXPECT(wav_stream_format(wav).sample_rate == 8000);
+        EXPECT(wav_stream_format(wav).channels == 1);
+        EXPECT(test_stream_holds(wav, samples, 1000, 1000));
+        wav_stream_close(wav);
+    }
+
+    // Cut the file in the middle of a frame
+    EXPECT(truncate(path, 44 + 501 * 2 + 1) == 0);
+    wav = wav_stream_open_read(path);
+    EXPECT(wav != NULL);
+    if (wav) {
+        EXPECT(wav_stream_frames(wav) == 501);
+        EXPECT(test_stream_holds(wav, samples, 501, 100));
+        wav_stream_close(wav);
+    }
+
+    // A bare data chunk with no `fmt ` is refused by the stream, but wav_load takes it
+    unsigned char bare[16 + 200];
+    memcpy(bare, "RIFF", 4);
+    test_put(bare + 4, sizeof(bare) - 8, 4);
+    memcpy(bare + 8, "WAVEdata", 8);
+    test_put(bare + 16, 200, 4);
+    memcpy(bare + 20, samples, 196);
+    FILE* file = fopen(path, "wb");
+    EXPECT(file && fwrite(bare, 1, 20 + 196, file) == 20 + 196);
+    if (file) fclose(file);
+    EXPECT(wav_stream_open_read(path) == NULL);
+    memset(loaded, 0, 200);
+    wav_load(path, loaded);
+    EXPECT(memcmp(loaded, samples, 196) == 0 && loaded[98] == 0);
+
+    unlink(path);
+    free(loaded);
+    free(samples);
+}
+
+// A track of hundreds of segments saves straight from its blocks and loads back the
+// same, as do files from other tools with an extensible header and odd-sized chunks
+void test_track_wav_round_trip() {
+    size_t len = 50000;
+    int16_t* samples = (int16_t*) malloc(len * sizeof(int16_t));
+    int16_t* read = (int16_t*) malloc(len * sizeof(int16_t));
+    test_noise(samples, len, 80);
+    sound_seg* source = test_track_of(samples, len);
+    sound_seg* track = test_track_of(samples, 5000);
+    uint64_t rng = 81;
+    for (size_t k = 0; k < 300; k++) {
+        size_t pos = test_next(&rng) % (tr_length(track) + 1);
+        tr_insert(source, track, pos, test_next(&rng) % (len - 100), 1 + test_next(&rng) % 100);
+    }
+    size_t track_len = tr_length(track);
+    tr_read(track, read, 0, track_len);
+    char path[128];
+    char saved[128];
+    test_wav_path(path, "track");
+    test_wav_path(saved, "saved");
+
+    EXPECT(tr_save_wav(track, path));
+    wav_stream* wav = wav_stream_open_read(path);
+    EXPECT(wav != NULL);
+    if (wav) {
+        EXPECT(wav_stream_format(wav).channels == 1);
+        EXPECT(test_stream_holds(wav, read, track_len, 7777));
+        wav_stream_close(wav);
+    }
+    sound_seg* loaded = tr_load_wav(path);
+    EXPECT(loaded != NULL && test_holds(loaded, read, track_len));
+    tr_destroy(loaded);
+
+    // The data of this file starts at an odd offset; save it elsewhere, since the loaded
+    // track maps it
+    test_write_extensible(path, samples, len, 1, 8000);
+    loaded = tr_load_wav(path);
+    EXPECT(loaded != NULL && test_holds(loaded, samples, len));
+    EXPECT(loaded != NULL && tr_save_wav(loaded, saved));
+    tr_destroy(loaded);
+    loaded = tr_load_wav(saved);
+    EXPECT(loaded != NULL && test_holds(loaded, samples, len));
+    tr_destroy(loaded);
+
+    unlink(saved);
+    unlink(path);
+    tr_destroy(track);
+    tr_destroy(source);
+    free(read);
+    free(samples);
+}
+
+// Stereo tracks count frames everywhere: writes, reads, inserts and deletes move whole
+// interleaved frames, a mono source cannot be inserted, identification matches per
+// frame, and WAV files keep the channel count and sample rate
+void test_stereo_frames() {
+    size_t frames = 4000;
+    int16_t* samples = (int16_t*) malloc(frames * 2 * sizeof(int16_t));
+    int16_t* model = (int16_t*) malloc(frames * 2 * 2 * sizeof(int16_t));
+    test_noise(samples, frames * 2, 90);
+    sound_seg* source = tr_init_fmt(2, 48000);
+    sound_seg* track = tr_init_fmt(2, 48000);
+    sound_seg* mono = test_track_of(samples, 100);
+    EXPECT(tr_init_fmt(0, 48000) == NULL);
+    EXPECT(tr_channels(track) == 2 && tr_sample_rate(track) == 48000);
+
+    tr_write(source, samples, 0, frames);
+    EXPECT(tr_length(source) == frames);
+
+    // track = source[1000, 1500) + source[0, 300) + source[3000, 3100), minus 50 frames at 100
+    tr_insert(source, track, 0, 1000, 500);
+    tr_insert(source, track, 500, 0, 300);
+    tr_insert(source, track, 800, 3000, 100);
+    EXPECT(tr_delete_range(track, 100, 50));
+    tr_insert(mono, track, 0, 0, 10);
+    size_t n = 0;
+    memcpy(model + n, samples + 1000 * 2, 100 * 2 * sizeof(int16_t));
+    n += 100 * 2;
+    memcpy(model + n, samples + 1150 * 2, 350 * 2 * sizeof(int16_t));
+    n += 350 * 2;
+    memcpy(model + n, samples, 300 * 2 * sizeof(int16_t));
+    n += 300 * 2;
+    memcpy(model + n, samples + 3000 * 2, 100 * 2 * sizeof(int16_t));
+    n += 100 * 2;
+    EXPECT(tr_length(track) == n / 2);
+
+    int16_t* read = (int16_t*) malloc(n * sizeof(int16_t));
+    tr_read(track, read, 0, n / 2);
+    EXPECT(memcmp(read, model, n * sizeof(int16_t)) == 0);
+    tr_read(track, read, 77, 3);
+    EXPECT(memcmp(read, model + 77 * 2, 3 * 2 * sizeof(int16_t)) == 0);
+
+    // The span iterator counts frames too
+    tr_span_iter it;
+    size_t run_len;
+    size_t done = 0;
+    const int16_t* data;
+    tr_span_begin(&it, track, 0, n / 2);
+    while ((data = tr_span_next(&it, &run_len))) {
+        EXPECT(memcmp(data, model + done * 2, run_len * 2 * sizeof(int16_t)) == 0);
+        done += run_len;
+    }
+    EXPECT(done == n / 2);
+
+    // A write through the copy lands in both channels of the source
+    int16_t frame[2] = { 1234, -1234 };
+    tr_write(track, frame, 0, 1);
+    tr_read(source, read, 1000, 1);
+    EXPECT(read[0] == 1234 && read[1] == -1234);
+    memcpy(model, frame, sizeof(frame));
+
+    // Identification: the ad is the frames copied from source[0, 300)
+    sound_seg* ad = tr_init_fmt(2, 48000);
+    tr_insert(track, ad, 0, 450, 300);
+    tr_match match;
+    EXPECT(tr_identify_matches(track, ad, &match, 1) == 1);
+    EXPECT(match.start == 450 && match.end == 749);
+    EXPECT(tr_identify_matches(track, mono, &match, 1) == 0);
+
+    // WAV round trip
+    char path[128];
+    test_wav_path(path, "stereo");
+    EXPECT(tr_save_wav(track, path));
+    sound_seg* loaded = tr_load_wav(path);
+    EXPECT(loaded != NULL);
+    if (loaded) {
+        EXPECT(tr_channels(loaded) == 2 && tr_sample_rate(loaded) == 48000);
+        EXPECT(tr_length(loaded) == n / 2);
+        tr_read(loaded, read, 0, n / 2);
+        EXPECT(memcmp(read, model, n * sizeof(int16_t)) == 0);
+        tr_destroy(loaded);
+    }
+    unlink(path);
+
+    tr_destroy(ad);
+    tr_destroy(mono);
+    tr_destroy(track);
+    tr_destroy(source);
+    free(read);
+    free(model);
+    free(samples);
+}
+
+// Return the number of segments a track is made of
+size_t test_segments(sound_seg* track) {
+    tr_track_stats stats;
+    return tr_stats(track, &stats) ? stats.segments : 0;
+}
+
+// Compacting a fragmented track, in small budgeted steps or in one call, with and without
+// copying short runs, removes segments but never changes a sample; samples shared with
+// other tracks keep receiving writes both ways
+void test_compact_preserves_samples() {
+    size_t len = 3000;
+    int16_t* samples = (int16_t*) malloc(len * sizeof(int16_t));
+    test_noise(samples, len, 100);
+    int16_t* model = (int16_t*) malloc(2 * len * sizeof(int16_t));
+    int16_t* read = (int16_t*) malloc(2 * len * sizeof(int16_t));
+    size_t merged = 0;
+
+    for (size_t copy_below = 0; copy_below <= 64; copy_below += 64) {
+        sound_seg* source = test_track_of(samples, len);
+        sound_seg* track = test_track_of(samples, len);
+        sound_seg* reader = tr_init();
+        uint64_t rng = 101;
+        // Split the track into neighbouring pieces of its block with an insert and a
+        // delete at each cut, then punch holes so the second half is short pieces apart
+        for (size_t k = 0; k < 100; k++) {
+            size_t pos = 1 + test_next(&rng) % (len - 2);
+            tr_insert(track, track, pos, 0, 1);
+            EXPECT(tr_delete_range(track, pos, 1));
+        }
+        for (size_t pos = len / 2; pos < tr_length(track); pos += 20) {
+            EXPECT(tr_delete_range(track, pos, 1));
+        }
+        // A piece of the source at the front, partly copied on into another track
+        tr_insert(source, track, 0, 500, 50);
+        tr_insert(track, reader, 0, 10, 30);
+        size_t track_len = tr_length(track);
+        tr_read(track, model, 0, track_len);
+        size_t before = test_segments(track);
+
+        tr_compact_policy policy = { copy_below, 7, 0, 0 };
+        size_t removed = 0;
+        size_t calls = 0;
+        while (policy.cursor < tr_length(track)) {
+            size_t step = tr_compact(track, &policy);
+            EXPECT(step != SIZE_MAX);
+            removed += step;
+            calls++;
+            EXPECT(test_holds(track, model, track_len));
+        }
+        EXPECT(calls > 1);
+        EXPECT(removed > 0 && test_segments(track) == before - removed);
+        // Copying also joins the short pieces between the holes
+        if (copy_below == 0) {
+            merged = removed;
+        }
+        EXPECT(copy_below == 0 || removed > merged);
+        policy.cursor = 0;
+        policy.max_segments = 0;
+        tr_compact(track, &policy);
+        EXPECT(test_holds(track, model, track_len));
+
+        // Writes through the track reach the reader, and the reverse
+        int16_t marker[30];
+        memset(marker, 0x11, sizeof(marker));
+        tr_write(track, marker, 10, 30);
+        tr_read(reader, read, 0, 30);
+        EXPECT(memcmp(read, marker, sizeof(marker)) == 0);
+        memset(marker, 0x22, sizeof(marker));
+        tr_write(reader, marker, 0, 30);
+        tr_read(track, read, 10, 30);
+        EXPECT(memcmp(read, marker, sizeof(marker)) == 0);
+
+        // And writes through the source reach the piece of it in the track
+        int16_t ramp[50];
+        for (size_t i = 0; i < 50; i++) {
+            ramp[i] = (int16_t)i;
+        }
+        tr_write(source, ramp, 500, 50);
+        tr_read(track, read, 0, 50);
+        EXPECT(memcmp(read, ramp, sizeof(ramp)) == 0);
+
+        tr_destroy(reader);
+        tr_destroy(track);
+        tr_destroy(source);
+    }
+    free(read);
+    free(model);
+    free(samples);
+}
+
+// Fill `target` with silence broken by quiet noise bursts, then plant copies of `ad`
+// changed by `gain` and `offset`, one per burst-free stretch; gains of each sign of the
+// threshold put matches and misses near it
+void test_sparse(int16_t* target, size_t target_len, const int16_t* ad, size_t ad_len,
+                 const double* gains, size_t count, int offset, uint64_t seed) {
+    memset(target, 0, target_len * sizeof(int16_t));
+    for (size_t pos = 0; pos + 2000 <= target_len; pos += 20000) {
+        for (size_t i = 0; i < 2000; i++) {
+            target[pos + i] = (int16_t)((int16_t) test_next(&seed) / 16);
+        }
+    }
+    size_t stride = target_len / count;
+    for (size_t k = 0; k < count; k++) {
+        size_t pos = k * stride + 3000 + test_next(&seed) % (stride - ad_len - 3000);
+        for (size_t i = 0; i < ad_len; i++) {
+            target[pos + i] = (int16_t)(gains[k] * ad[i] + offset);
+        }
+    }
+}
+
+// Return the matches of a double-precision normalized cross-correlation at every offset,
+// with a skip past each, as "start,end" lines
+char* test_naive_ncc(const int16_t* target, size_t target_len, const int16_t* ad,
+                     size_t ad_len) {
+    char* results = (char*) malloc(target_len / ad_len * 48 + 1);
+    size_t length = 0;
+    results[0] = '\0';
+    double ad_mean = 0.0;
+    for (size_t i = 0; i < ad_len; i++) {
+        ad_mean += ad[i];
+    }
+    ad_mean /= ad_len;
+    for (size_t pos = 0; pos + ad_len <= target_len; pos++) {
+        double mean = 0.0;
+        for (size_t i = 0; i < ad_len; i++) {
+            mean += target[pos + i];
+        }
+        mean /= ad_len;
+        double covariance = 0.0, window_energy = 0.0, ad_energy = 0.0;
+        for (size_t i = 0; i < ad_len; i++) {
+            double x = target[pos + i] - mean;
+            double y = ad[i] - ad_mean;
+            covariance += x * y;
+            window_energy += x * x;
+            ad_energy += y * y;
+        }
+        if (window_energy > 0.0 && covariance > 0.0 &&
+            covariance * covariance >= 0.95 * 0.95 * window_energy * ad_energy) {
+            length += sprintf(results + length, "%s%zu,%zu", length ? "\n" : "", pos,
+                              pos + ad_len - 1);
+            pos += ad_len - 1;
+        }
+    }
+    return results;
+}
+
+// Return matches in tr_identify's format
+char* test_format(const tr_match* matches, size_t count) {
+    char* results = (char*) malloc(count * 48 + 1);
+    size_t length = 0;
+    results[0] = '\0';
+    for (size_t i = 0; i < count; i++) {
+        length += sprintf(results + length, "%s%zu,%zu", length ? "\n" : "", matches[i].start,
+                          matches[i].end);
+    }
+    return results;
+}
+
+// Skipping windows too quiet to match must not change the matches of a mostly silent
+// target, on the direct path or the FFT path, and the normalized mode must find copies
+// at any gain and DC offset exactly where a full normalized scan does
+void test_pruning_matches_full_scan() {
+    static const size_t ad_lens[] = { 50, 700 };
+    static const double gains[] = { 1.0, 0.98, 0.96, 0.94, 0.9, 1.5, 0.5, -1.0 };
+    size_t count = sizeof(gains) / sizeof(gains[0]);
+    size_t target_len = 1 << 17;
+    int16_t* target = (int16_t*) malloc(target_len * sizeof(int16_t));
+    int16_t ad[700];
+    tr_match matches[64];
+
+    for (size_t a = 0; a < sizeof(ad_lens) / sizeof(ad_lens[0]); a++) {
+        size_t ad_len = ad_lens[a];
+        test_noise(ad, ad_len, 30 + a);
+        for (size_t i = 0; i < ad_len; i++) {
+            ad[i] /= 4;
+        }
+        sound_seg* ad_track = test_track_of(ad, ad_len);
+
+        // Gains from 0.94 down miss the default threshold; 1.5 matches by dot product
+        test_sparse(target, target_len, ad, ad_len, gains, count, 0, 40 + a);
+        sound_seg* target_track = test_track_of(target, target_len);
+        char* expected = test_naive_identify(target, target_len, ad, ad_len);
+        char* found = tr_identify(target_track, ad_track);
+        EXPECT(strcmp(found, expected) == 0);
+        size_t n = tr_identify_ex(target_track, ad_track, NULL, matches, 64);
+        EXPECT(n == 4);
+        char* listed = test_format(matches, n < 64 ? n : 64);
+        EXPECT(strcmp(listed, expected) == 0);
+        free(listed);
+        free(found);
+        free(expected);
+        tr_destroy(target_track);
+
+        // Shifted by a DC offset, every copy of positive gain matches by correlation
+        test_sparse(target, target_len, ad, ad_len, gains, count, 300, 40 + a);
+        target_track = test_track_of(target, target_len);
+        tr_identify_opts opts = { true, 0.0, 0, 0.0 };
+        expected = test_naive_ncc(target, target_len, ad, ad_len);
+        n = tr_identify_ex(target_track, ad_track, &opts, matches, 64);
+        EXPECT(n == count - 1);
+        listed = test_format(matches, n < 64 ? n : 64);
+        EXPECT(strcmp(listed, expected) == 0);
+        for (size_t i = 0; i < n && i < 64; i++) {
+            EXPECT(matches[i].score > 0.99 && matches[i].score < 1.0 + 1e-9);
+        }
+        free(listed);
+        free(expected);
+        tr_destroy(target_track);
+        tr_destroy(ad_track);
+    }
+    free(target);
+}
+
+// Coarse-to-fine identification caches pyramids per track; writing an ad into samples the
+// target shares with another track, through that track, must still be found
+void test_coarse_sees_shared_write() {
+    size_t target_len = 1 << 16;
+    size_t ad_len = 2048;
+    size_t at = 20000;
+    int16_t* samples = (int16_t*) malloc(target_len * sizeof(int16_t));
+    test_noise(samples, target_len, 3);
+    sound_seg* target = test_track_of(samples, target_len);
+    test_noise(samples, ad_len, 4);
+    sound_seg* source = test_track_of(samples, ad_len);
+    test_noise(samples, ad_len, 6);
+    sound_seg* other = test_track_of(samples, ad_len);
+    test_noise(samples, ad_len, 5);
+    sound_seg* ad = test_track_of(samples, ad_len);
+    tr_insert(source, target, at, 0, ad_len);
+    tr_identify_opts opts = { false, 0.0, 3, 0.0 };
+    tr_match match;
+
+    EXPECT(tr_identify_ex(target, ad, &opts, &match, 1) == 0);
+
+    tr_write(other, samples, 0, ad_len);
+    EXPECT(tr_identify_ex(target, ad, &opts, &match, 1) == 0);
+
+    tr_write(source, samples, 0, ad_len);
+    EXPECT(tr_identify_ex(target, ad, &opts, &match, 1) == 1);
+    EXPECT(match.start == at);
+    free(samples);
+
+    tr_destroy(other);
+    tr_destroy(ad);
+    tr_destroy(source);
+    tr_destroy(target);
+}
+
+// A named test
+typedef struct test_case {
+    const char* name;
+    void (*run)();
+} test_case;
+
+int main() {
+    static const test_case tests[] = {
+        { "edits_match_model", test_edits_match_model },
+        { "fft_matches_naive_scan", test_fft_matches_naive_scan },
+        { "dot_kernels_exact", test_dot_kernels_exact },
+        { "identify_mt_matches_identify", test_identify_mt_matches_identify },
+        { "stream_matches_identify", test_stream_matches_identify },
+        { "identify_many_matches_identify", test_identify_many_matches_identify },
+        { "append_after_insert", test_append_after_insert },
+        { "cover_protects_source", test_cover_protects_source },
+        { "snapshot_isolation", test_snapshot_isolation },
+        { "batch_self_insert", test_batch_self_insert },
+        { "wav_stream_round_trip", test_wav_stream_round_trip },
+        { "track_wav_round_trip", test_track_wav_round_trip },
+        { "stereo_frames", test_stereo_frames },
+        { "compact_preserves_samples", test_compact_preserves_samples },
+        { "pruning_matches_full_scan", test_pruning_matches_full_scan },
+        { "coarse_sees_shared_write", test_coarse_sees_shared_write },
+    };
+
+    int failed = 0;
+    for (size_t i = 0; i < sizeof(tests) / sizeof(tests[0]); i++) {
+        test_failures = 0;
+        tests[i].run();
+        printf("%s %s\n", test_failures == 0 ? "ok  " : "FAIL", tests[i].name);
+        failed += test_failures != 0;
+    }
+    return failed;
+}
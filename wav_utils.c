@@ -1,73 +1,349 @@
+#define _POSIX_C_SOURCE 200809L
 #include "wav_utils.h"
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 
-// Reads PCM data from a WAV file and stores in dest
-void wav_load(const char* fname, int16_t* dest) {
-    FILE* file = fopen(fname, "rb");
-    if (!file) return;
+// Size of the stdio buffer of a stream, so the file is read and written in large requests
+#define WAV_IO_BUFFER (1 << 20)
+
+// Alignment of that buffer, one page
+#define WAV_IO_ALIGN 4096
+
+// Format tag of WAVE_FORMAT_EXTENSIBLE, whose sub-format names the real encoding
+#define WAV_FORMAT_EXTENSIBLE 0xFFFE
 
-    char header[4];
-    fread(header, 1, 4, file); // "RIFF"
-    uint32_t fileSize;
-    fread(&fileSize, 4, 1, file); // overall size
-    fread(header, 1, 4, file); // "WAVE"
+// Read a little-endian 16-bit field
+uint16_t wav_u16(const unsigned char* p) {
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+// Read a little-endian 32-bit field
+uint32_t wav_u32(const unsigned char* p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
 
-    while (1) {
-        fread(header, 1, 4, file);
-        uint32_t chunkSize;
-        fread(&chunkSize, 4, 1, file);
+// Write a little-endian 16-bit field
+void wav_put_u16(unsigned char* p, uint16_t value) {
+    p[0] = (unsigned char)value;
+    p[1] = (unsigned char)(value >> 8);
+}
+
+// Write a little-endian 32-bit field
+void wav_put_u32(unsigned char* p, uint32_t value) {
+    wav_put_u16(p, (uint16_t)value);
+    wav_put_u16(p + 2, (uint16_t)(value >> 16));
+}
+
+// Decode a `fmt ` chunk body of `size` bytes, reporting extensible PCM as plain PCM
+bool wav_read_fmt(const unsigned char* body, size_t size, wav_format* format) {
+    if (size < 16) {
+        return false;
+    }
+
+    format->audio_format = wav_u16(body);
+    format->channels = wav_u16(body + 2);
+    format->sample_rate = wav_u32(body + 4);
+    format->bits_per_sample = wav_u16(body + 14);
+    if (format->audio_format == WAV_FORMAT_EXTENSIBLE && size >= 26) {
+        format->audio_format = wav_u16(body + 24);
+    }
+    return true;
+}
+
+// Walk the RIFF chunks, bounds-checking every header against the buffer
+// A `data` chunk declared longer than the file is cut at the end of the file
+bool wav_parse(const void* bytes, size_t size, wav_format* format, size_t* data_offset, size_t* data_size) {
+    const unsigned char* p = (const unsigned char*) bytes;
+    if (size < 12 || memcmp(p, "RIFF", 4) != 0 || memcmp(p + 8, "WAVE", 4) != 0) {
+        return false;
+    }
+
+    bool have_format = false;
+    size_t pos = 12;
+    while (size - pos >= 8) {
+        size_t body = pos + 8;
+        size_t chunk_size = wav_u32(p + pos + 4);
+
+        if (memcmp(p + pos, "fmt ", 4) == 0) {
+            size_t available = (chunk_size < size - body) ? chunk_size : size - body;
+            if (!wav_read_fmt(p + body, available, format)) {
+                return false;
+            }
+            have_format = true;
+        }
+        else if (memcmp(p + pos, "data", 4) == 0) {
+            if (!have_format) {
+                return false;
+            }
+            *data_offset = body;
+            *data_size = (chunk_size < size - body) ? chunk_size : size - body;
+            return true;
+        }
 
-        if (header[0] == 'd' && header[1] == 'a' && header[2] == 't' && header[3] == 'a') {
-            fread(dest, sizeof(int16_t), chunkSize / sizeof(int16_t), file);
+        // Chunks are padded to an even length
+        if (chunk_size > size - body) {
+            break;
+        }
+        pos = body + chunk_size + (chunk_size & 1);
+        if (pos > size) {
             break;
         }
-        fseek(file, chunkSize, SEEK_CUR);
-        if (feof(file)) break;
     }
+    return false;
+}
 
-    fclose(file);
+// An open WAV file and where the stream is in its samples
+struct wav_stream {
+    FILE* file;
+    char* buffer;              // the file's stdio buffer
+    wav_format format;
+    bool writing;
+    bool failed;               // a read or write came up short
+    size_t frames;             // frames in the data chunk, or written so far
+    size_t position;           // frames read so far
+};
+
+// Return the bytes in one frame of the stream
+size_t wav_frame_size(const wav_stream* wav) {
+    return (size_t)wav->format.channels * sizeof(int16_t);
 }
 
-// Writes PCM data to a WAV file
-void wav_save(const char* fname, const int16_t* src, size_t len) {
-    FILE* file = fopen(fname, "wb");
-    if (!file) return;
+// Check that a format can be streamed as interleaved 16-bit samples
+bool wav_format_supported(const wav_format* format) {
+    return format->audio_format == WAV_FORMAT_PCM && format->bits_per_sample == 16 &&
+           format->channels > 0;
+}
 
-    const char RIFF[] = "RIFF";
-    fwrite(RIFF, 1, 4, file);
+// Open a file with a large page-aligned stdio buffer
+wav_stream* wav_stream_create(const char* fname, const char* mode) {
+    wav_stream* wav = (wav_stream*) calloc(1, sizeof(wav_stream));
+    if (!wav) return NULL;
 
-    uint32_t fileSize = len * sizeof(int16_t) + 36;
-    fwrite(&fileSize, 1, 4, file);
+    wav->buffer = (char*) aligned_alloc(WAV_IO_ALIGN, WAV_IO_BUFFER);
+    wav->file = wav->buffer ? fopen(fname, mode) : NULL;
+    if (!wav->file) {
+        free(wav->buffer);
+        free(wav);
+        return NULL;
+    }
+    setvbuf(wav->file, wav->buffer, _IOFBF, WAV_IO_BUFFER);
+    return wav;
+}
 
-    const char WAVE[] = "WAVE";
-    fwrite(WAVE, 1, 4, file);
+// Close the file and free the stream, returning false if closing failed
+bool wav_stream_free(wav_stream* wav) {
+    bool ok = fclose(wav->file) == 0;
+    free(wav->buffer);
+    free(wav);
+    return ok;
+}
 
-    const char fmt[] = "fmt ";
-    fwrite(fmt, 1, 4, file);
+// Read chunk headers up to the `data` chunk, leaving the file at its first sample
+// Every read is checked and every skip is bounded by the file size, so a truncated or
+// corrupt file fails instead of looping
+bool wav_stream_parse(wav_stream* wav) {
+    struct stat st;
+    if (fstat(fileno(wav->file), &st) != 0) {
+        return false;
+    }
+    off_t file_size = st.st_size;
 
-    uint32_t fmtSize = 16;
-    fwrite(&fmtSize, 1, 4, file);
+    unsigned char header[12];
+    if (fread(header, 1, 12, wav->file) != 12 ||
+        memcmp(header, "RIFF", 4) != 0 || memcmp(header + 8, "WAVE", 4) != 0) {
+        return false;
+    }
 
-    uint16_t audioFormat = 1;
-    uint16_t numChannels = 1;
-    uint32_t sampleRate = 8000;
-    uint32_t byteRate = sampleRate * numChannels * sizeof(int16_t);
-    uint16_t blockAlign = numChannels * sizeof(int16_t);
-    uint16_t bitsPerSample = 16;
+    bool have_format = false;
+    off_t pos = 12;
+    for (;;) {
+        unsigned char chunk[8];
+        if (fread(chunk, 1, 8, wav->file) != 8) {
+            return false;
+        }
+        pos += 8;
+        uint32_t chunk_size = wav_u32(chunk + 4);
 
-    fwrite(&audioFormat, 1, 2, file);
-    fwrite(&numChannels, 1, 2, file);
-    fwrite(&sampleRate, 1, 4, file);
-    fwrite(&byteRate, 1, 4, file);
-    fwrite(&blockAlign, 1, 2, file);
-    fwrite(&bitsPerSample, 1, 2, file);
+        if (memcmp(chunk, "data", 4) == 0) {
+            if (!have_format) {
+                return false;
+            }
+            off_t available = file_size - pos;
+            size_t bytes = ((off_t)chunk_size < available) ? chunk_size : (size_t)available;
+            wav->frames = bytes / wav_frame_size(wav);
+            return true;
+        }
 
-    const char data[] = "data";
-    fwrite(data, 1, 4, file);
+        off_t skip = (off_t)chunk_size + (chunk_size & 1);
+        if (skip > file_size - pos) {
+            return false;
+        }
+        if (memcmp(chunk, "fmt ", 4) == 0) {
+            unsigned char body[40];
+            size_t want = chunk_size < sizeof(body) ? chunk_size : sizeof(body);
+            if (fread(body, 1, want, wav->file) != want || !wav_read_fmt(body, want, &wav->format) ||
+                !wav_format_supported(&wav->format)) {
+                return false;
+            }
+            have_format = true;
+            skip -= (off_t)want;
+        }
+        if (skip > 0 && fseeko(wav->file, skip, SEEK_CUR) != 0) {
+            return false;
+        }
+        pos += (off_t)chunk_size + (chunk_size & 1);
+    }
+}
+
+// Fill in the canonical 44-byte header: RIFF, a 16-byte PCM `fmt ` chunk, and `data`
+void wav_header(unsigned char* header, const wav_format* format, uint32_t data_size) {
+    uint16_t block_align = (uint16_t)(format->channels * sizeof(int16_t));
+    memcpy(header, "RIFF", 4);
+    wav_put_u32(header + 4, data_size + WAV_HEADER_SIZE - 8);
+    memcpy(header + 8, "WAVE", 4);
+    memcpy(header + 12, "fmt ", 4);
+    wav_put_u32(header + 16, 16);
+    wav_put_u16(header + 20, WAV_FORMAT_PCM);
+    wav_put_u16(header + 22, format->channels);
+    wav_put_u32(header + 24, format->sample_rate);
+    wav_put_u32(header + 28, format->sample_rate * block_align);
+    wav_put_u16(header + 32, block_align);
+    wav_put_u16(header + 34, 16);
+    memcpy(header + 36, "data", 4);
+    wav_put_u32(header + 40, data_size);
+}
 
-    uint32_t dataSize = len * sizeof(int16_t);
-    fwrite(&dataSize, 1, 4, file);
-    fwrite(src, sizeof(int16_t), len, file);
+// Open a file and position it at the start of its samples
+wav_stream* wav_stream_open_read(const char* fname) {
+    wav_stream* wav = wav_stream_create(fname, "rb");
+    if (!wav) return NULL;
 
+    if (!wav_stream_parse(wav)) {
+        wav_stream_free(wav);
+        return NULL;
+    }
+    return wav;
+}
+
+// Write a header with empty sizes, which wav_stream_close fills in
+wav_stream* wav_stream_open_write(const char* fname, const wav_format* format) {
+    if (!format || !wav_format_supported(format)) {
+        return NULL;
+    }
+
+    wav_stream* wav = wav_stream_create(fname, "wb");
+    if (!wav) return NULL;
+
+    wav->format = *format;
+    wav->writing = true;
+
+    unsigned char header[WAV_HEADER_SIZE];
+    wav_header(header, format, 0);
+    if (fwrite(header, 1, WAV_HEADER_SIZE, wav->file) != WAV_HEADER_SIZE) {
+        wav_stream_free(wav);
+        return NULL;
+    }
+    return wav;
+}
+
+// Return the format of the file
+wav_format wav_stream_format(const wav_stream* wav) {
+    return wav->format;
+}
+
+// Return the frame count of the file
+size_t wav_stream_frames(const wav_stream* wav) {
+    return wav->frames;
+}
+
+// Read frames straight into `dest`; stdio passes large requests through to the file
+size_t wav_stream_read(wav_stream* wav, int16_t* dest, size_t frames) {
+    if (!wav || wav->writing || !dest) {
+        return 0;
+    }
+
+    size_t remaining = wav->frames - wav->position;
+    if (frames > remaining) {
+        frames = remaining;
+    }
+
+    size_t got = fread(dest, wav_frame_size(wav), frames, wav->file);
+    if (got < frames) {
+        wav->failed = true;
+    }
+    wav->position += got;
+    return got;
+}
+
+// Append frames, refusing any that would not fit in the 32-bit chunk sizes
+bool wav_stream_write(wav_stream* wav, const int16_t* src, size_t frames) {
+    if (!wav || !wav->writing || (!src && frames > 0)) {
+        return false;
+    }
+
+    size_t frame_size = wav_frame_size(wav);
+    size_t limit = (UINT32_MAX - (WAV_HEADER_SIZE - 8)) / frame_size;
+    if (frames > limit - wav->frames) {
+        return false;
+    }
+
+    size_t put = fwrite(src, frame_size, frames, wav->file);
+    wav->frames += put;
+    if (put < frames) {
+        wav->failed = true;
+        return false;
+    }
+    return true;
+}
+
+// Close the stream, patching the RIFF and data sizes of a written file
+bool wav_stream_close(wav_stream* wav) {
+    if (!wav) {
+        return false;
+    }
+
+    bool ok = !wav->failed;
+    if (wav->writing) {
+        uint32_t data_size = (uint32_t)(wav->frames * wav_frame_size(wav));
+        unsigned char size[4];
+        wav_put_u32(size, data_size + WAV_HEADER_SIZE - 8);
+        ok = ok && fseeko(wav->file, 4, SEEK_SET) == 0 && fwrite(size, 1, 4, wav->file) == 4;
+        wav_put_u32(size, data_size);
+        ok = ok && fseeko(wav->file, 40, SEEK_SET) == 0 && fwrite(size, 1, 4, wav->file) == 4;
+    }
+    return wav_stream_free(wav) && ok;
+}
+
+// Reads PCM data from a WAV file and stores in dest
+// Unlike the stream reader this checks nothing: with or without a `fmt ` chunk, and in any
+// format, the first `data` chunk is copied as 16-bit samples, up to the end of the file
+void wav_load(const char* fname, int16_t* dest) {
+    FILE* file = fopen(fname, "rb");
+    if (!file) return;
+
+    unsigned char header[12];
+    if (fread(header, 1, 12, file) == 12) {
+        while (fread(header, 1, 8, file) == 8) {
+            uint32_t size = wav_u32(header + 4);
+            if (memcmp(header, "data", 4) == 0) {
+                fread(dest, sizeof(int16_t), size / sizeof(int16_t), file);
+                break;
+            }
+            if (fseeko(file, (off_t)size + (size & 1), SEEK_CUR) != 0) break;
+        }
+    }
     fclose(file);
 }
+
+// Writes PCM data to a WAV file
+void wav_save(const char* fname, const int16_t* src, size_t len) {
+    wav_format format = { WAV_FORMAT_PCM, 1, 8000, 16 };
+    wav_stream* wav = wav_stream_open_write(fname, &format);
+    if (!wav) return;
+
+    wav_stream_write(wav, src, len);
+    wav_stream_close(wav);
+}
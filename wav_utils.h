@@ -3,6 +3,57 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <stdbool.h>
+
+// Format tag of uncompressed PCM samples
+#define WAV_FORMAT_PCM 1
+
+// The fields of a WAV file's `fmt ` chunk that describe its samples
+typedef struct wav_format {
+    uint16_t audio_format;
+    uint16_t channels;
+    uint32_t sample_rate;
+    uint16_t bits_per_sample;
+} wav_format;
+
+// Parse the chunks of a WAV file held in memory. Stores the format and the byte range of
+// the `data` chunk, clamped to the buffer. Returns false unless the buffer holds a RIFF
+// WAVE file with a `fmt ` chunk followed by a `data` chunk.
+bool wav_parse(const void* bytes, size_t size, wav_format* format, size_t* data_offset, size_t* data_size);
+
+// Bytes of the canonical header of a 16-bit PCM file, which precede its samples
+#define WAV_HEADER_SIZE 44
+
+// Fill `header` with the canonical header for `data_size` bytes of samples in `format`.
+void wav_header(unsigned char* header, const wav_format* format, uint32_t data_size);
+
+// A WAV file read or written a few frames at a time. A frame holds one 16-bit sample
+// per channel, interleaved.
+typedef struct wav_stream wav_stream;
+
+// Open a 16-bit PCM WAV file for reading. Returns NULL if it cannot be opened or parsed.
+wav_stream* wav_stream_open_read(const char* fname);
+
+// Create a WAV file for writing frames of the given format, which must be 16-bit PCM.
+wav_stream* wav_stream_open_write(const char* fname, const wav_format* format);
+
+// Return the format of the file.
+wav_format wav_stream_format(const wav_stream* wav);
+
+// Return the frames in the file when reading, or written so far when writing.
+size_t wav_stream_frames(const wav_stream* wav);
+
+// Read up to `frames` frames into `dest`. Returns the number read, which is less only
+// at the end of the data or on a read error.
+size_t wav_stream_read(wav_stream* wav, int16_t* dest, size_t frames);
+
+// Append `frames` frames from `src`. Returns false on a write error or if the file
+// would outgrow the 4 GiB limit of the format.
+bool wav_stream_write(wav_stream* wav, const int16_t* src, size_t frames);
+
+// Close the file, first filling in the sizes in the header when writing.
+// Returns false if any read or write on the stream failed.
+bool wav_stream_close(wav_stream* wav);
 
 // Load a WAV file
 void wav_load(const char* fname, int16_t* dest);
@@ -0,0 +1,199 @@
+#include "xcorr.h"
+#include "fft_utils.h"
+#include <stdlib.h>
+#include <string.h>
+#include <float.h>
+
+// Smallest FFT used for a block; shorter patterns still amortise the transform cost
+#define XCORR_MIN_FFT 4096
+
+// One pattern pre-transformed at the plan's FFT length
+typedef struct xcorr_pattern {
+    size_t ad_len;
+    double ad_norm1;          // sum of |ad[i]|, used for the error bound
+    fft_complex* spectrum;    // conjugated spectrum of the zero-padded pattern
+} xcorr_pattern;
+
+// Patterns sharing one FFT length for overlap-save correlation
+struct xcorr_plan {
+    size_t fft_len;
+    size_t step;
+    double error_scale;       // rounding error per unit of |window|_1 * |ad|_1
+    fft_plan* fft;
+    size_t count;
+    xcorr_pattern* patterns;
+};
+
+// Scratch space for transforming one block
+struct xcorr_work {
+    fft_complex* spectrum;    // spectrum of the loaded block
+    fft_complex* product;     // spectrum of one pattern's correlation
+    double* block;
+    size_t window_len;
+    double window_norm1;
+};
+
+// Create a plan for a single pattern
+xcorr_plan* xcorr_plan_create(const int16_t* ad, size_t ad_len) {
+    return xcorr_plan_create_many(&ad, &ad_len, 1);
+}
+
+// Create a plan whose FFT is at least four times the longest pattern
+xcorr_plan* xcorr_plan_create_many(const int16_t* const* ads, const size_t* ad_lens, size_t count) {
+    if (!ads || !ad_lens || count == 0) {
+        return NULL;
+    }
+
+    size_t max_len = 0;
+    for (size_t k = 0; k < count; k++) {
+        if (!ads[k] || ad_lens[k] == 0) {
+            return NULL;
+        }
+        if (ad_lens[k] > max_len) {
+            max_len = ad_lens[k];
+        }
+    }
+
+    xcorr_plan* plan = (xcorr_plan*) calloc(1, sizeof(xcorr_plan));
+    if (!plan) return NULL;
+
+    size_t fft_len = XCORR_MIN_FFT;
+    while (fft_len < 4 * max_len) {
+        fft_len <<= 1;
+    }
+
+    plan->fft_len = fft_len;
+    plan->step = fft_len - max_len + 1;
+    plan->fft = fft_plan_create(fft_len);
+    plan->patterns = (xcorr_pattern*) calloc(count, sizeof(xcorr_pattern));
+    double* padded = (double*) malloc(fft_len * sizeof(double));
+    if (!plan->fft || !plan->patterns || !padded) {
+        free(padded);
+        xcorr_plan_destroy(plan);
+        return NULL;
+    }
+
+    double log_len = 0.0;
+    for (size_t n = fft_len; n > 1; n >>= 1) {
+        log_len += 1.0;
+    }
+    // Three transforms each contribute O(eps * log n) relative error; keep a wide margin
+    plan->error_scale = 16.0 * (log_len + 1.0) * DBL_EPSILON;
+
+    for (size_t k = 0; k < count; k++) {
+        xcorr_pattern* pattern = &plan->patterns[k];
+        pattern->ad_len = ad_lens[k];
+        pattern->spectrum = (fft_complex*) malloc((fft_len / 2 + 1) * sizeof(fft_complex));
+        if (!pattern->spectrum) {
+            free(padded);
+            xcorr_plan_destroy(plan);
+            return NULL;
+        }
+        plan->count++;
+
+        memset(padded, 0, fft_len * sizeof(double));
+        for (size_t i = 0; i < ad_lens[k]; i++) {
+            padded[i] = ads[k][i];
+            pattern->ad_norm1 += (ads[k][i] < 0) ? -(double)ads[k][i] : (double)ads[k][i];
+        }
+        fft_forward_real(plan->fft, padded, pattern->spectrum);
+        for (size_t i = 0; i <= fft_len / 2; i++) {
+            pattern->spectrum[i].im = -pattern->spectrum[i].im;
+        }
+    }
+
+    free(padded);
+    return plan;
+}
+
+// Destroy a plan and its buffers
+void xcorr_plan_destroy(xcorr_plan* plan) {
+    if (!plan) return;
+
+    for (size_t k = 0; k < plan->count; k++) {
+        free(plan->patterns[k].spectrum);
+    }
+    free(plan->patterns);
+    fft_plan_destroy(plan->fft);
+    free(plan);
+}
+
+// Allocate the block buffers one thread needs to run a plan
+xcorr_work* xcorr_work_create(const xcorr_plan* plan) {
+    xcorr_work* work = (xcorr_work*) calloc(1, sizeof(xcorr_work));
+    if (!work) return NULL;
+
+    work->spectrum = (fft_complex*) malloc((plan->fft_len / 2 + 1) * sizeof(fft_complex));
+    work->product = (fft_complex*) malloc((plan->fft_len / 2 + 1) * sizeof(fft_complex));
+    work->block = (double*) malloc(plan->fft_len * sizeof(double));
+    if (!work->spectrum || !work->product || !work->block) {
+        xcorr_work_destroy(work);
+        return NULL;
+    }
+    return work;
+}
+
+// Destroy per-thread block buffers
+void xcorr_work_destroy(xcorr_work* work) {
+    if (!work) return;
+
+    free(work->spectrum);
+    free(work->product);
+    free(work->block);
+    free(work);
+}
+
+// Return the number of offsets evaluated per block
+size_t xcorr_step(const xcorr_plan* plan) {
+    return plan->step;
+}
+
+// Transform one block of the signal, zero padded to the FFT length
+void xcorr_load(const xcorr_plan* plan, xcorr_work* work, const int16_t* window, size_t window_len) {
+    size_t fft_len = plan->fft_len;
+    if (window_len > fft_len) {
+        window_len = fft_len;
+    }
+
+    double window_norm1 = 0.0;
+    for (size_t i = 0; i < window_len; i++) {
+        work->block[i] = window[i];
+        window_norm1 += (window[i] < 0) ? -(double)window[i] : (double)window[i];
+    }
+    memset(work->block + window_len, 0, (fft_len - window_len) * sizeof(double));
+
+    fft_forward_real(plan->fft, work->block, work->spectrum);
+    work->window_len = window_len;
+    work->window_norm1 = window_norm1;
+}
+
+// Correlate the loaded block with one pattern; outputs that would wrap around are discarded
+double xcorr_apply(const xcorr_plan* plan, xcorr_work* work, size_t pattern_index, double* out) {
+    const xcorr_pattern* pattern = &plan->patterns[pattern_index];
+    if (work->window_len < pattern->ad_len) {
+        return 0.0;
+    }
+
+    for (size_t k = 0; k <= plan->fft_len / 2; k++) {
+        fft_complex x = work->spectrum[k];
+        fft_complex y = pattern->spectrum[k];
+        work->product[k].re = x.re * y.re - x.im * y.im;
+        work->product[k].im = x.re * y.im + x.im * y.re;
+    }
+    fft_inverse_real(plan->fft, work->product, work->block);
+
+    size_t count = work->window_len - pattern->ad_len + 1;
+    if (count > plan->step) {
+        count = plan->step;
+    }
+    memcpy(out, work->block, count * sizeof(double));
+
+    return plan->error_scale * work->window_norm1 * pattern->ad_norm1 + 1.0;
+}
+
+// Correlate one block with the first pattern
+double xcorr_run(const xcorr_plan* plan, xcorr_work* work,
+                 const int16_t* window, size_t window_len, double* out) {
+    xcorr_load(plan, work, window, window_len);
+    return xcorr_apply(plan, work, 0, out);
+}
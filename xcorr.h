@@ -0,0 +1,45 @@
+#ifndef XCORR_H
+#define XCORR_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Overlap-save cross-correlation of int16 signals against fixed patterns.
+// A plan is read-only once created and can be shared between threads.
+typedef struct xcorr_plan xcorr_plan;
+
+// Per-thread scratch buffers for running a plan.
+typedef struct xcorr_work xcorr_work;
+
+// Create a plan correlating against the `ad_len` samples of `ad`.
+xcorr_plan* xcorr_plan_create(const int16_t* ad, size_t ad_len);
+
+// Create a plan for `count` patterns that share one FFT length, so each signal block
+// is transformed once for all of them.
+xcorr_plan* xcorr_plan_create_many(const int16_t* const* ads, const size_t* ad_lens, size_t count);
+
+// Destroy a plan created by xcorr_plan_create or xcorr_plan_create_many.
+void xcorr_plan_destroy(xcorr_plan* plan);
+
+// Allocate scratch buffers for running `plan`.
+xcorr_work* xcorr_work_create(const xcorr_plan* plan);
+
+// Destroy scratch buffers created by xcorr_work_create.
+void xcorr_work_destroy(xcorr_work* work);
+
+// Return how many consecutive offsets one block evaluates for every pattern.
+size_t xcorr_step(const xcorr_plan* plan);
+
+// Transform a block of `window_len` signal samples (at most step + longest pattern - 1).
+void xcorr_load(const xcorr_plan* plan, xcorr_work* work, const int16_t* window, size_t window_len);
+
+// Correlate the loaded block with pattern `pattern_index`. Writes
+// min(step, window_len - ad_len + 1) approximate dot products to `out` and returns an
+// upper bound on the absolute rounding error of any of them.
+double xcorr_apply(const xcorr_plan* plan, xcorr_work* work, size_t pattern_index, double* out);
+
+// Load `window` and correlate it with the first pattern.
+double xcorr_run(const xcorr_plan* plan, xcorr_work* work,
+                 const int16_t* window, size_t window_len, double* out);
+
+#endif // XCORR_H